@@ -16,18 +16,41 @@
 
 #include "config.h"
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include <ctype.h> /* isalnum */
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <locale.h> /* setlocale */
+#include <poll.h>
+#include <regex.h>
+#include <stddef.h> /* offsetof */
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h> /* strdup, strlen */
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
 
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/*
+ * SSE2 is the baseline, AVX2 code is built anyway with gcc and clang
+ * and used only if the CPU supports it.
+ */
+#if defined(__SSE2__)
+#include <immintrin.h>
+#if defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
 #include <X11/Xcms.h>
 #include <X11/Xlib.h>
 #include <X11/Xresource.h>
@@ -42,9 +65,80 @@
 
 #define SYM_BUF_SIZE 4
 
+/* How much to read(2) at once and how big the arena chunks are */
+#define READ_BUF_SIZE (64 * 1024)
+#define ARENA_CHUNK_SIZE (1024 * 1024)
+
+/*
+ * Slack after the folded items, so the vectors loaded by fsearch()
+ * never go past the end of the buffer.
+ */
+#define FOLD_PAD 32
+
+/* Inputs bigger than this are indexed by multiple threads */
+#define PARALLEL_SCAN_MIN (64 * 1024 * 1024)
+#define PARALLEL_MATCH_MIN (128 * 1024)
+
+/* The most threads that index or filter the items */
+#define MAX_THREADS 32
+
+/*
+ * How many items are filtered at once to fill the screen, and then
+ * to complete the completions when there's nothing else to do.  The
+ * steps to fill the screen grow up to FILL_STEP_MAX items, so that a
+ * query that is already stale is dropped soon.
+ */
+#define LAZY_STEP (4 * 1024)
+#define IDLE_STEP (256 * 1024)
+#define FILL_STEP_MAX (1024 * 1024)
+
+/*
+ * How long, in milliseconds, the worker is waited for after a key
+ * before drawing the window with the old completions.
+ */
+#define WORKER_WAIT 10
+
+/* The trigrams are hashed in this many posting lists */
+#define TRIGRAM_BITS 20
+#define TRIGRAM_LISTS (1 << TRIGRAM_BITS)
+
 #define DEFFONT "monospace"
 
-#define ARGS "Aahmve:p:P:l:f:W:H:x:y:b:B:t:T:c:C:s:S:d:G:g:I:i:J:j:"
+/* Default memory for the query snapshots, in MB */
+#define DEFSNAPSHOTS 64
+
+/* How many fuzzy matches are ranked */
+#define FUZZY_TOP 1000
+
+/* How many compiled regular expressions are kept around */
+#define REGEX_CACHE 16
+
+/* How many items can have their matches marked, see marks_get() */
+#define MARKS_MAX 1024
+
+/* How many widths of the items drawn are kept, see item_width() */
+#define WIDTHS_CACHE 4096
+
+/*
+ * The history of the items picked: how many slots a new one has, in
+ * how many seconds a pick is worth half, and the scores below which,
+ * in 1/256 of a pick, the items are forgotten when it's rewritten.
+ */
+#define HISTORY_MAGIC "mymenuH1"
+#define HISTORY_SLOTS 1024
+#define HISTORY_HALFLIFE (7 * 24 * 60 * 60)
+#define HISTORY_FORGET 8
+
+/* The fuzzy scores, more or less like fzf(1) */
+#define SCORE_MATCH 16
+#define SCORE_GAP_START (-3)
+#define SCORE_GAP (-1)
+#define BONUS_BOUNDARY 8
+#define BONUS_CAMEL 7
+#define BONUS_CONSECUTIVE 4
+#define SCORE_PICK 16 /* for a pick just made, see history_score() */
+
+#define ARGS "0AahmvXe:p:P:l:f:F:W:H:x:y:b:B:t:T:c:C:s:S:d:G:g:I:i:J:j:M:R:"
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
@@ -63,6 +157,9 @@ enum state { LOOPING, OK_LOOP, OK, ERR };
  */
 enum obj_type { PROMPT, COMPL, COMPL_HIGH };
 
+/* How the query is matched against the items */
+enum match_mode { MATCH_SUBSTRING, MATCH_FUZZY, MATCH_REGEX };
+
 /* These are the possible action to be performed after user input. */
 enum action {
 	NO_OP,
@@ -80,11 +177,57 @@ enum action {
 	SCROLL_UP,
 };
 
+/* The width of the index-th item, in pixels */
+struct width {
+	uint32_t index;
+	int width;
+};
+
+/* A box of a completion, as drawn in the vertical layout */
+struct box {
+	uint32_t index; /* of the item */
+	short high; /* it's the selected one */
+	short keep; /* it's already in the back buffer, see damage() */
+	int pos; /* the Y */
+	int size;
+	int moved; /* since the last frame */
+};
+
+/* The metrics of a codepoint in the font, see glyph_get() */
+struct glyph {
+	uint32_t cp;
+	short adv; /* how far the pen moves */
+	short right; /* where the ink ends, from the pen */
+};
+
 /* A big set of values that needs to be carried around for drawing. A
  * big struct to rule them all */
 struct rendering {
 	Display *d; /* Connection to xorg */
 	Window w;
+
+	/*
+	 * Everything is drawn on `buf', as big as the window, and then
+	 * copied on it with `copygc', see present().
+	 */
+	Pixmap buf;
+	int bufwidth;
+	int bufheight;
+	int depth;
+	GC copygc;
+
+	/*
+	 * The boxes of the completions drawn in the back buffer, when
+	 * they're the vertical layout of `drawn' with its marks of
+	 * generation `drawngen', and the ones of the next frame.
+	 */
+	struct box *boxes;
+	size_t nboxes;
+	struct box *next;
+	size_t nnext;
+	size_t boxescap;
+	const struct completions *drawn;
+	unsigned long drawngen;
 	XIM xim;
 	int width;
 	int height;
@@ -100,6 +243,7 @@ struct rendering {
 	short free_text;
 	short first_selected;
 	short multiple_select;
+	short nul_output; /* terminate the selections with NUL */
 
 	/* four border width */
 	int borders[4];
@@ -117,6 +261,10 @@ struct rendering {
 
 	int text_height; /* cache for the vertical layout */
 
+	short loading; /* still reading the items */
+	size_t nitems; /* number of items read so far */
+	short filtering; /* the worker is busy with the completions */
+
 	XIC xic;
 
 	/* colors */
@@ -128,25 +276,293 @@ struct rendering {
 	GC ch_borders_bg[4];
 	XftFont *font;
 	XftDraw *xftdraw;
-	XftColor xft_colors[3];
-};
+	XftColor xft_colors[4];
 
-struct completion {
-	char *completion;
-	char *rcompletion;
+	/*
+	 * The widths of the items drawn with `font', a cache indexed
+	 * by the index of the item modulo WIDTHS_CACHE.
+	 */
+	struct width *widths;
 
 	/*
-	 * The X (or Y, depending on the layour) at which the item is
-	 * rendered
+	 * The metrics of the codepoints of `font': the first 256 are
+	 * loaded with it, the others are put in a hash table, with
+	 * linear probing, the first time they're drawn.
 	 */
-	ssize_t offset;
+	struct glyph latin1[256];
+	struct glyph *glyphs;
+	size_t nglyphs;
+	size_t glyphscap;
+};
+
+/*
+ * What a word of the query must match, see tokenize(): TK_NONE is an
+ * operator alone, that matches everything.
+ */
+enum token_kind {
+	TK_NONE,
+	TK_WORD, /* a substring, or a fuzzy match */
+	TK_EXACT, /* a substring, even with MATCH_FUZZY */
+	TK_PREFIX,
+	TK_SUFFIX,
+	TK_EQUAL, /* the whole text */
+};
+
+/* A word of the query, pointing into it, without the operators */
+struct token {
+	const char *s;
+	size_t len;
+	enum token_kind kind;
+	short neg; /* the items that match it are discarded */
+};
+
+/* A run of bytes of an item, [start, end), that matches the query */
+struct mark {
+	uint32_t start;
+	uint32_t end;
+};
+
+/* Where the marks of the index-th item are */
+struct marked {
+	uint32_t index;
+	uint32_t first;
+	uint32_t n;
+};
+
+/* A compiled regular expression, see regex_get() */
+struct regex {
+	char *pattern;
+	regex_t re;
+	int valid; /* regcomp() succeeded */
+	unsigned long used; /* when it was last used */
+};
+
+/*
+ * The completions for a previous query, kept around so that going
+ * back to it doesn't need to filter the items again.
+ */
+struct snapshot {
+	char *query;
+	size_t querylen;
+	uint32_t *completions;
+	int *scores;
+	size_t length;
+	size_t ranked;
+	size_t nitems;
 };
 
-/* Wrap the linked list of completions */
+/* Wrap the list of completions */
 struct completions {
-	struct completion *completions;
+	/*
+	 * The indexes of the items that match and, only if they're
+	 * ranked, their scores, see compls_reserve().  The text is
+	 * looked up in `items'.
+	 */
+	uint32_t *completions;
+	int *scores;
+	const struct items *items;
 	ssize_t selected;
 	size_t length;
+	size_t cap;
+
+	/*
+	 * With MATCH_FUZZY the first `ranked' completions are the best
+	 * ones, sorted by score.  With `frecency' the scores of the
+	 * items in the history are added, and in the other modes the
+	 * first `ranked' are the ones in it.  The others are in the
+	 * order of the items.
+	 */
+	enum match_mode mode;
+	short frecency;
+	size_t ranked;
+
+	/* the folded text the completions were filtered with */
+	char *query;
+	size_t querylen;
+	uint64_t qmask; /* the presence mask of the query */
+	size_t nitems; /* how many items were filtered */
+
+	/*
+	 * The words of the query, all of them must match.  The first
+	 * `checked' are known to match, see narrow().  `plan' are the
+	 * indexes of the words in the order they're tried, see
+	 * tokens_plan().
+	 */
+	struct token *tokens;
+	size_t ntokens;
+	size_t tokenscap;
+	size_t checked;
+	size_t *plan;
+	size_t nplan;
+
+	/*
+	 * With MATCH_REGEX the words are instead the literals that the
+	 * regex needs, stored in `lits', and `rx' is the regex of the
+	 * query, among the last ones used.
+	 */
+	char *lits;
+	struct regex regexes[REGEX_CACHE];
+	size_t nregexes;
+	unsigned long rxclock;
+	struct regex *rx;
+
+	/*
+	 * The marks of the items drawn, for the current query, see
+	 * marks_get().  `marksgen' changes with the query.
+	 */
+	unsigned long marksgen;
+	struct mark *marks;
+	size_t nmarks;
+	size_t markscap;
+	struct marked *marked;
+	size_t nmarked;
+	size_t markedcap;
+
+	/*
+	 * The X (or Y, depending on the layout) at which the
+	 * completions from r->offset were drawn, see draw().
+	 */
+	ssize_t *offsets;
+	size_t noffsets;
+	size_t offsetscap;
+
+	/*
+	 * Snapshots of the completions for the prefixes of the query,
+	 * the longest one last, and the memory they use.
+	 */
+	struct snapshot *snaps;
+	size_t nsnaps;
+	size_t snapscap;
+	size_t snapsmem;
+	size_t snapsmax;
+};
+
+/*
+ * A piece of the arena where the items are stored.  Chunks are never
+ * moved or resized, so the items can safely point into them.
+ */
+struct chunk {
+	struct chunk *next;
+	size_t len;
+	size_t cap;
+	char data[];
+};
+
+/* The offsets of the delimiters found by scan() */
+struct scan {
+	size_t *pos;
+	size_t len;
+	size_t cap;
+};
+
+/*
+ * The history file: this header and then `nslots' slots, a hash
+ * table with linear probing of the hashes of the items picked.  A
+ * slot with a zero hash is free.  The scores are in 1/256 of a pick
+ * and halve every HISTORY_HALFLIFE seconds since `last'.
+ */
+struct history_head {
+	char magic[8];
+	uint32_t nslots;
+	uint32_t nused;
+};
+
+struct history_slot {
+	uint64_t hash;
+	uint32_t score;
+	uint32_t last;
+};
+
+/*
+ * The history, mapped privately so the updates, written with
+ * pwrite(2) one slot at a time, are seen by us too.
+ */
+struct history {
+	int fd;
+	char *map;
+	size_t maplen;
+	struct history_head *head;
+	struct history_slot *slots;
+	uint32_t now;
+};
+
+/*
+ * An inverted index of the trigrams of the folded items, as posting
+ * lists of item indexes.  The list of the trigrams with hash `h' is
+ * posts[offs[h]] to posts[offs[h + 1]], sorted.
+ */
+struct trigrams {
+	size_t *offs;
+	uint32_t *posts;
+	size_t nitems; /* how many items are indexed */
+};
+
+/*
+ * The items read from stdin.  They're not NUL-terminated when the
+ * input is mmap'd, so always use their length.
+ */
+struct items {
+	char **lines; /* pointers into the arena or the mmap'd file */
+	char **vlines; /* the text to render, NULL if there's no separator */
+	uint32_t *lens; /* the length of every line */
+	char **folded; /* the text to match, folded to lower case */
+	uint64_t *masks; /* the bytes in every item, see presence() */
+	size_t nmasks; /* how many masks are computed */
+	size_t len;
+	size_t cap;
+	const char *sep;
+	size_t seplen;
+	int delim; /* what separates the items, '\n' or NUL */
+
+	char *map; /* the input file, if it was mmap'd */
+	size_t maplen;
+
+	int fd; /* -1 once the whole input was read */
+	struct chunk *chunks; /* the arena, the current chunk is the first */
+	size_t partial; /* start of the incomplete line in the chunk */
+	struct chunk *fchunks; /* where the folded items are */
+	struct scan sc; /* reused by readlines() */
+
+	short use_index; /* build the trigram index once read */
+	struct trigrams *tri;
+	uint32_t *sorted; /* the items by folded text, see sorted_build() */
+
+	struct history *hist; /* NULL if not used */
+	int *frec; /* the score of every item in the history */
+};
+
+/*
+ * The thread that filters the items, so that the window is redrawn
+ * and the keys are read while a big list is filtered.  While it's
+ * busy the completions belong to it and the event loop only draws
+ * `view', a copy of what was on the screen, with the new text.
+ * Every job bumps `gen', and a query is dropped as soon as it's not
+ * the last one.  When there's nothing left to do a byte is written
+ * to done[1], polled by the event loop.  Without pthreads, or if the
+ * thread can't be started, the jobs are run when they're submitted.
+ */
+struct worker {
+	struct completions *cs;
+	struct items *items;
+	struct completions view;
+	int done[2];
+	short started;
+
+	/* the next job: a query, or a step of the idle work if NULL */
+	char *text;
+	size_t want;
+	short first_selected;
+	short pending;
+
+	short busy; /* there's a job pending or running */
+	short quit;
+	unsigned int gen; /* of the last job submitted */
+	unsigned int jobgen; /* of the one running */
+#if HAVE_PTHREAD
+	pthread_t th;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+#endif
 };
 
 /* idea stolen from lemonbar;  ty lemonboy */
@@ -169,278 +585,3149 @@ compls_new(size_t length)
 	if (cs == NULL)
 		return cs;
 
-	cs->completions = calloc(length, sizeof(struct completion));
+	cs->completions = calloc(length, sizeof(uint32_t));
 	if (cs->completions == NULL) {
 		free(cs);
 		return NULL;
 	}
 
+	cs->scores = NULL;
+	cs->items = NULL;
 	cs->selected = -1;
-	cs->length = length;
+	cs->length = 0;
+	cs->cap = length;
+	cs->mode = MATCH_SUBSTRING;
+	cs->frecency = 0;
+	cs->ranked = 0;
+	cs->query = NULL;
+	cs->querylen = 0;
+	cs->nitems = 0;
+	cs->tokens = NULL;
+	cs->ntokens = 0;
+	cs->tokenscap = 0;
+	cs->checked = 0;
+	cs->plan = NULL;
+	cs->nplan = 0;
+	cs->lits = NULL;
+	cs->nregexes = 0;
+	cs->rxclock = 0;
+	cs->rx = NULL;
+	cs->marksgen = 0;
+	cs->marks = NULL;
+	cs->nmarks = 0;
+	cs->markscap = 0;
+	cs->marked = NULL;
+	cs->nmarked = 0;
+	cs->markedcap = 0;
+	cs->offsets = NULL;
+	cs->noffsets = 0;
+	cs->offsetscap = 0;
+	cs->snaps = NULL;
+	cs->nsnaps = 0;
+	cs->snapscap = 0;
+	cs->snapsmem = 0;
+	cs->snapsmax = 0;
 	return cs;
 }
 
+/* Are the completions ranked, so that they need their scores? */
+static int
+compls_scored(const struct completions *cs)
+{
+	return cs->mode == MATCH_FUZZY || cs->frecency;
+}
+
+/* The memory used by `n' completions, and their `scores' if any */
+static size_t
+compls_size(size_t n, const int *scores)
+{
+	return n * (sizeof(uint32_t) + (scores != NULL ? sizeof(int) : 0));
+}
+
+/*
+ * Make room for `n' completions.  The scores are only allocated when
+ * they're needed, so that the plain matches take 4 bytes each.
+ */
+static void
+compls_reserve(struct completions *cs, size_t n)
+{
+	size_t newcap;
+	void *t;
+
+	if (cs->cap < n) {
+		newcap = MAX(n, cs->cap * 1.5);
+		t = reallocarray(cs->completions, newcap, sizeof(uint32_t));
+		if (t == NULL)
+			err(1, "reallocarray");
+		cs->completions = t;
+		if (cs->scores != NULL) {
+			t = reallocarray(cs->scores, newcap, sizeof(int));
+			if (t == NULL)
+				err(1, "reallocarray");
+			cs->scores = t;
+		}
+		cs->cap = newcap;
+	}
+
+	if (cs->scores == NULL && compls_scored(cs)) {
+		if ((cs->scores = calloc(cs->cap, sizeof(int))) == NULL)
+			err(1, "calloc");
+	}
+}
+
+/* Drop the i-th snapshot */
+static void
+snap_drop(struct completions *cs, size_t i)
+{
+	struct snapshot *s = &cs->snaps[i];
+
+	cs->snapsmem -= compls_size(s->length, s->scores);
+	free(s->query);
+	free(s->completions);
+	free(s->scores);
+
+	cs->nsnaps--;
+	memmove(s, s + 1, (cs->nsnaps - i) * sizeof(*s));
+}
+
+/*
+ * Save the current completions as a snapshot.  Their memory is taken
+ * over by the snapshot, so the completions are left empty.  The
+ * oldest snapshots, i.e. the biggest ones, are dropped if the memory
+ * used goes over the limit.  Return -1 if the completions are too
+ * big to be saved at all.
+ */
+static int
+snap_push(struct completions *cs)
+{
+	struct snapshot *s;
+	size_t size;
+	void *t;
+
+	size = compls_size(cs->length, cs->scores);
+	if (size > cs->snapsmax)
+		return -1;
+
+	if (cs->nsnaps == cs->snapscap) {
+		size_t newcap;
+
+		newcap = MAX(cs->snapscap * 2, 8);
+		t = reallocarray(cs->snaps, newcap, sizeof(*s));
+		if (t == NULL)
+			err(1, "reallocarray");
+		cs->snaps = t;
+		cs->snapscap = newcap;
+	}
+
+	s = &cs->snaps[cs->nsnaps++];
+	s->query = cs->query;
+	s->querylen = cs->querylen;
+	s->completions = cs->completions;
+	s->scores = cs->scores;
+	s->length = cs->length;
+	s->ranked = cs->ranked;
+	s->nitems = cs->nitems;
+	cs->snapsmem += size;
+
+	cs->query = NULL;
+	cs->querylen = 0;
+	cs->completions = NULL;
+	cs->scores = NULL;
+	cs->cap = 0;
+	compls_reserve(cs, MAX(cs->length, 32));
+	cs->length = 0;
+	cs->ranked = 0;
+
+	/* the one just pushed always fits */
+	while (cs->snapsmem > cs->snapsmax)
+		snap_drop(cs, 0);
+
+	return 0;
+}
+
+/*
+ * Replace the current completions with the last snapshot, that is
+ * removed from the stack.
+ */
+static void
+snap_pop(struct completions *cs)
+{
+	struct snapshot *s = &cs->snaps[--cs->nsnaps];
+
+	free(cs->query);
+	free(cs->completions);
+	free(cs->scores);
+
+	cs->query = s->query;
+	cs->querylen = s->querylen;
+	cs->completions = s->completions;
+	cs->scores = s->scores;
+	cs->length = s->length;
+	cs->cap = s->length;
+	cs->ranked = s->ranked;
+	cs->nitems = s->nitems;
+	cs->snapsmem -= compls_size(s->length, s->scores);
+}
+
 /* Delete the wrapper and the whole list */
 static void
 compls_delete(struct completions *cs)
 {
+	size_t i;
+
 	if (cs == NULL)
 		return;
 
+	while (cs->nsnaps > 0)
+		snap_drop(cs, cs->nsnaps - 1);
+	free(cs->snaps);
+
+	for (i = 0; i < cs->nregexes; ++i) {
+		free(cs->regexes[i].pattern);
+		if (cs->regexes[i].valid)
+			regfree(&cs->regexes[i].re);
+	}
+
 	free(cs->completions);
+	free(cs->scores);
+	free(cs->query);
+	free(cs->tokens);
+	free(cs->plan);
+	free(cs->marks);
+	free(cs->marked);
+	free(cs->offsets);
+	free(cs->lits);
 	free(cs);
 }
 
 /*
- * Create a completion list from a text and the list of possible
- * completions (null terminated). Expects a non-null `cs'. `lines' and
- * `vlines' should have the same length OR `vlines' is NULL.
+ * The Unicode 14 case folding of the codepoints past ASCII, as runs
+ * of codepoints that are folded adding `delta'; in the runs with a
+ * stride of 2 only every other codepoint is.  The foldings that
+ * change the length of the UTF-8 encoding (e.g. U+0130, U+212A) are
+ * left out, so that the folded text keeps the offsets of the
+ * original one.
  */
-static void
-filter(struct completions *cs, char *text, char **lines, char **vlines)
+static const struct fold_range {
+	uint32_t lo;
+	uint32_t hi;
+	int32_t delta;
+	uint32_t stride;
+} fold_ranges[] = {
+	{ 0x00b5, 0x00b5, 775, 1 }, { 0x00c0, 0x00d6, 32, 1 },
+	{ 0x00d8, 0x00de, 32, 1 }, { 0x0100, 0x012e, 1, 2 },
+	{ 0x0132, 0x0136, 1, 2 }, { 0x0139, 0x0147, 1, 2 },
+	{ 0x014a, 0x0176, 1, 2 }, { 0x0178, 0x0178, -121, 1 },
+	{ 0x0179, 0x017d, 1, 2 }, { 0x0181, 0x0181, 210, 1 },
+	{ 0x0182, 0x0184, 1, 2 }, { 0x0186, 0x0186, 206, 1 },
+	{ 0x0187, 0x0187, 1, 1 }, { 0x0189, 0x018a, 205, 1 },
+	{ 0x018b, 0x018b, 1, 1 }, { 0x018e, 0x018e, 79, 1 },
+	{ 0x018f, 0x018f, 202, 1 }, { 0x0190, 0x0190, 203, 1 },
+	{ 0x0191, 0x0191, 1, 1 }, { 0x0193, 0x0193, 205, 1 },
+	{ 0x0194, 0x0194, 207, 1 }, { 0x0196, 0x0196, 211, 1 },
+	{ 0x0197, 0x0197, 209, 1 }, { 0x0198, 0x0198, 1, 1 },
+	{ 0x019c, 0x019c, 211, 1 }, { 0x019d, 0x019d, 213, 1 },
+	{ 0x019f, 0x019f, 214, 1 }, { 0x01a0, 0x01a4, 1, 2 },
+	{ 0x01a6, 0x01a6, 218, 1 }, { 0x01a7, 0x01a7, 1, 1 },
+	{ 0x01a9, 0x01a9, 218, 1 }, { 0x01ac, 0x01ac, 1, 1 },
+	{ 0x01ae, 0x01ae, 218, 1 }, { 0x01af, 0x01af, 1, 1 },
+	{ 0x01b1, 0x01b2, 217, 1 }, { 0x01b3, 0x01b5, 1, 2 },
+	{ 0x01b7, 0x01b7, 219, 1 }, { 0x01b8, 0x01b8, 1, 1 },
+	{ 0x01bc, 0x01bc, 1, 1 }, { 0x01c4, 0x01c4, 2, 1 },
+	{ 0x01c5, 0x01c5, 1, 1 }, { 0x01c7, 0x01c7, 2, 1 },
+	{ 0x01c8, 0x01c8, 1, 1 }, { 0x01ca, 0x01ca, 2, 1 },
+	{ 0x01cb, 0x01db, 1, 2 }, { 0x01de, 0x01ee, 1, 2 },
+	{ 0x01f1, 0x01f1, 2, 1 }, { 0x01f2, 0x01f4, 1, 2 },
+	{ 0x01f6, 0x01f6, -97, 1 }, { 0x01f7, 0x01f7, -56, 1 },
+	{ 0x01f8, 0x021e, 1, 2 }, { 0x0220, 0x0220, -130, 1 },
+	{ 0x0222, 0x0232, 1, 2 }, { 0x023b, 0x023b, 1, 1 },
+	{ 0x023d, 0x023d, -163, 1 }, { 0x0241, 0x0241, 1, 1 },
+	{ 0x0243, 0x0243, -195, 1 }, { 0x0244, 0x0244, 69, 1 },
+	{ 0x0245, 0x0245, 71, 1 }, { 0x0246, 0x024e, 1, 2 },
+	{ 0x0345, 0x0345, 116, 1 }, { 0x0370, 0x0372, 1, 2 },
+	{ 0x0376, 0x0376, 1, 1 }, { 0x037f, 0x037f, 116, 1 },
+	{ 0x0386, 0x0386, 38, 1 }, { 0x0388, 0x038a, 37, 1 },
+	{ 0x038c, 0x038c, 64, 1 }, { 0x038e, 0x038f, 63, 1 },
+	{ 0x0391, 0x03a1, 32, 1 }, { 0x03a3, 0x03ab, 32, 1 },
+	{ 0x03c2, 0x03c2, 1, 1 }, { 0x03cf, 0x03cf, 8, 1 },
+	{ 0x03d0, 0x03d0, -30, 1 }, { 0x03d1, 0x03d1, -25, 1 },
+	{ 0x03d5, 0x03d5, -15, 1 }, { 0x03d6, 0x03d6, -22, 1 },
+	{ 0x03d8, 0x03ee, 1, 2 }, { 0x03f0, 0x03f0, -54, 1 },
+	{ 0x03f1, 0x03f1, -48, 1 }, { 0x03f4, 0x03f4, -60, 1 },
+	{ 0x03f5, 0x03f5, -64, 1 }, { 0x03f7, 0x03f7, 1, 1 },
+	{ 0x03f9, 0x03f9, -7, 1 }, { 0x03fa, 0x03fa, 1, 1 },
+	{ 0x03fd, 0x03ff, -130, 1 }, { 0x0400, 0x040f, 80, 1 },
+	{ 0x0410, 0x042f, 32, 1 }, { 0x0460, 0x0480, 1, 2 },
+	{ 0x048a, 0x04be, 1, 2 }, { 0x04c0, 0x04c0, 15, 1 },
+	{ 0x04c1, 0x04cd, 1, 2 }, { 0x04d0, 0x052e, 1, 2 },
+	{ 0x0531, 0x0556, 48, 1 }, { 0x10a0, 0x10c5, 7264, 1 },
+	{ 0x10c7, 0x10c7, 7264, 1 }, { 0x10cd, 0x10cd, 7264, 1 },
+	{ 0x13f8, 0x13fd, -8, 1 }, { 0x1c88, 0x1c88, 35267, 1 },
+	{ 0x1c90, 0x1cba, -3008, 1 }, { 0x1cbd, 0x1cbf, -3008, 1 },
+	{ 0x1e00, 0x1e94, 1, 2 }, { 0x1e9b, 0x1e9b, -58, 1 },
+	{ 0x1ea0, 0x1efe, 1, 2 }, { 0x1f08, 0x1f0f, -8, 1 },
+	{ 0x1f18, 0x1f1d, -8, 1 }, { 0x1f28, 0x1f2f, -8, 1 },
+	{ 0x1f38, 0x1f3f, -8, 1 }, { 0x1f48, 0x1f4d, -8, 1 },
+	{ 0x1f59, 0x1f5f, -8, 2 }, { 0x1f68, 0x1f6f, -8, 1 },
+	{ 0x1f88, 0x1f8f, -8, 1 }, { 0x1f98, 0x1f9f, -8, 1 },
+	{ 0x1fa8, 0x1faf, -8, 1 }, { 0x1fb8, 0x1fb9, -8, 1 },
+	{ 0x1fba, 0x1fbb, -74, 1 }, { 0x1fbc, 0x1fbc, -9, 1 },
+	{ 0x1fc8, 0x1fcb, -86, 1 }, { 0x1fcc, 0x1fcc, -9, 1 },
+	{ 0x1fd8, 0x1fd9, -8, 1 }, { 0x1fda, 0x1fdb, -100, 1 },
+	{ 0x1fe8, 0x1fe9, -8, 1 }, { 0x1fea, 0x1feb, -112, 1 },
+	{ 0x1fec, 0x1fec, -7, 1 }, { 0x1ff8, 0x1ff9, -128, 1 },
+	{ 0x1ffa, 0x1ffb, -126, 1 }, { 0x1ffc, 0x1ffc, -9, 1 },
+	{ 0x2132, 0x2132, 28, 1 }, { 0x2160, 0x216f, 16, 1 },
+	{ 0x2183, 0x2183, 1, 1 }, { 0x24b6, 0x24cf, 26, 1 },
+	{ 0x2c00, 0x2c2f, 48, 1 }, { 0x2c60, 0x2c60, 1, 1 },
+	{ 0x2c63, 0x2c63, -3814, 1 }, { 0x2c67, 0x2c6b, 1, 2 },
+	{ 0x2c72, 0x2c72, 1, 1 }, { 0x2c75, 0x2c75, 1, 1 },
+	{ 0x2c80, 0x2ce2, 1, 2 }, { 0x2ceb, 0x2ced, 1, 2 },
+	{ 0x2cf2, 0x2cf2, 1, 1 }, { 0xa640, 0xa66c, 1, 2 },
+	{ 0xa680, 0xa69a, 1, 2 }, { 0xa722, 0xa72e, 1, 2 },
+	{ 0xa732, 0xa76e, 1, 2 }, { 0xa779, 0xa77b, 1, 2 },
+	{ 0xa77d, 0xa77d, -35332, 1 }, { 0xa77e, 0xa786, 1, 2 },
+	{ 0xa78b, 0xa78b, 1, 1 }, { 0xa790, 0xa792, 1, 2 },
+	{ 0xa796, 0xa7a8, 1, 2 }, { 0xa7b3, 0xa7b3, 928, 1 },
+	{ 0xa7b4, 0xa7c2, 1, 2 }, { 0xa7c4, 0xa7c4, -48, 1 },
+	{ 0xa7c6, 0xa7c6, -35384, 1 }, { 0xa7c7, 0xa7c9, 1, 2 },
+	{ 0xa7d0, 0xa7d0, 1, 1 }, { 0xa7d6, 0xa7d8, 1, 2 },
+	{ 0xa7f5, 0xa7f5, 1, 1 }, { 0xab70, 0xabbf, -38864, 1 },
+	{ 0xff21, 0xff3a, 32, 1 }, { 0x10400, 0x10427, 40, 1 },
+	{ 0x104b0, 0x104d3, 40, 1 }, { 0x10570, 0x1057a, 39, 1 },
+	{ 0x1057c, 0x1058a, 39, 1 }, { 0x1058c, 0x10592, 39, 1 },
+	{ 0x10594, 0x10595, 39, 1 }, { 0x10c80, 0x10cb2, 64, 1 },
+	{ 0x118a0, 0x118bf, 32, 1 }, { 0x16e40, 0x16e5f, 32, 1 },
+	{ 0x1e900, 0x1e921, 34, 1 },
+};
+
+/* Return the case folding of the codepoint `c' */
+static uint32_t
+fold_cp(uint32_t c)
 {
-	size_t index = 0;
-	size_t matching = 0;
-	char *l;
+	const struct fold_range *f;
+	size_t lo = 0, hi, mid;
+
+	hi = sizeof(fold_ranges) / sizeof(fold_ranges[0]);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		f = &fold_ranges[mid];
+		if (c < f->lo)
+			hi = mid;
+		else if (c > f->hi)
+			lo = mid + 1;
+		else if ((c - f->lo) % f->stride == 0)
+			return c + f->delta;
+		else
+			return c;
+	}
+	return c;
+}
 
-	if (vlines == NULL)
-		vlines = lines;
+/*
+ * Decode the UTF-8 sequence, at most `len' bytes, at `s' in `c'.
+ * Return its length, or 0 if it's not valid.
+ */
+static size_t
+utf8_decode(const unsigned char *s, size_t len, uint32_t *c)
+{
+	size_t i, n;
+	uint32_t min;
+
+	if (s[0] >= 0xc0 && s[0] < 0xe0) {
+		n = 2;
+		min = 0x80;
+		*c = s[0] & 0x1f;
+	} else if (s[0] >= 0xe0 && s[0] < 0xf0) {
+		n = 3;
+		min = 0x800;
+		*c = s[0] & 0x0f;
+	} else if (s[0] >= 0xf0 && s[0] < 0xf5) {
+		n = 4;
+		min = 0x10000;
+		*c = s[0] & 0x07;
+	} else
+		return 0;
 
-	while (1) {
-		if (lines[index] == NULL)
-			break;
+	if (n > len)
+		return 0;
+	for (i = 1; i < n; ++i) {
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
+		*c = (*c << 6) | (s[i] & 0x3f);
+	}
 
-		l = vlines[index] != NULL ? vlines[index] : lines[index];
+	/* no overlong encodings or surrogates */
+	if (*c < min || *c > 0x10ffff || (*c >= 0xd800 && *c < 0xe000))
+		return 0;
+	return n;
+}
 
-		if (strcasestr(l, text) != NULL) {
-			struct completion *c = &cs->completions[matching];
-			c->completion = l;
-			c->rcompletion = lines[index];
-			matching++;
-		}
+/* Encode `c' in UTF-8 in `n' bytes, as many as it needs, at `d' */
+static void
+utf8_encode(unsigned char *d, uint32_t c, size_t n)
+{
+	static const unsigned char lead[] = { 0, 0, 0xc0, 0xe0, 0xf0 };
+	size_t i;
 
-		index++;
+	for (i = n - 1; i > 0; --i) {
+		d[i] = 0x80 | (c & 0x3f);
+		c >>= 6;
 	}
-	cs->length = matching;
-	cs->selected = -1;
+	d[0] = lead[n] | c;
 }
 
-/* Update the given completion */
+/*
+ * Fold in place the codepoints past ASCII of the `len' bytes at `d',
+ * that was copied from `s' by fold().  The invalid UTF-8 sequences
+ * are left as they are.
+ */
 static void
-update_completions(struct completions *cs, char *text, char **lines,
-    char **vlines, short first_selected)
+fold_utf8(char *d, const char *s, size_t len)
 {
-	filter(cs, text, lines, vlines);
-	if (first_selected && cs->length > 0)
-		cs->selected = 0;
+	const unsigned char *u = (const unsigned char *)s;
+	size_t i, n;
+	uint32_t c, f;
+
+	for (i = 0; i < len; i += n) {
+		if (u[i] < 0x80 || (n = utf8_decode(u + i, len - i, &c)) == 0) {
+			n = 1;
+			continue;
+		}
+		if ((f = fold_cp(c)) != c)
+			utf8_encode((unsigned char *)d + i, f, n);
+	}
 }
 
 /*
- * Select the next or previous selection and update some state. `text'
- * will be updated with the text of the completion and `textlen' with
- * the new length. If the memory cannot be allocated `status' will be
- * set to `ERR'.
+ * Copy `len' bytes from `s' to `d' folded to lower case.  The ASCII
+ * letters are lowercased without branches, so that the compiler can
+ * vectorize it, and only if there was a byte past ASCII, something
+ * rare in most lists, the text is decoded to fold the others too.
+ * The length is never changed.
  */
 static void
-complete(struct completions *cs, short first_selected, short p,
-    char **text, int *textlen, enum state *status)
+fold(char *d, const char *s, size_t len)
 {
-	struct completion *n;
-	int index;
+	size_t i;
+	unsigned char c, high = 0;
 
-	if (cs == NULL || cs->length == 0)
-		return;
+	for (i = 0; i < len; ++i) {
+		c = s[i];
+		high |= c;
+		d[i] = c | ((unsigned char)(c - 'A') < 26) << 5;
+	}
 
-	/*
-	 * If the first is always selected and the first entry is
-	 * different from the text, expand the text and return
-	 */
-	if (first_selected &&
-	    cs->selected == 0 &&
-	    strcmp(cs->completions->completion, *text) != 0 &&
-	    !p) {
-		free(*text);
-		*text = strdup(cs->completions->completion);
-		if (text == NULL) {
-			*status = ERR;
-			return;
+	if (high & 0x80)
+		fold_utf8(d, s, len);
+}
+
+#if defined(__SSE2__)
+/*
+ * Search the first and the last byte of the needle at 16 positions
+ * of `h' at once and compare the rest only where both match.  The
+ * positions past the end are masked out, but the loads may still
+ * read up to FOLD_PAD bytes after `h + hlen'.
+ */
+static char *
+fsearch_sse2(const char *h, size_t hlen, const char *n, size_t nlen)
+{
+	__m128i first, last, bf, bl;
+	size_t i, j, end;
+	uint32_t m;
+
+	first = _mm_set1_epi8(n[0]);
+	last = _mm_set1_epi8(n[nlen - 1]);
+	end = hlen - nlen + 1;
+	for (i = 0; i < end; i += 16) {
+		bf = _mm_loadu_si128((const __m128i *)(h + i));
+		bl = _mm_loadu_si128((const __m128i *)(h + i + nlen - 1));
+		m = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(bf, first),
+		    _mm_cmpeq_epi8(bl, last)));
+		if (end - i < 16)
+			m &= (1U << (end - i)) - 1;
+		for (; m != 0; m &= m - 1) {
+			j = i + __builtin_ctz(m);
+			if (nlen < 3 || memcmp(h + j + 1, n + 1, nlen - 2) == 0)
+				return (char *)h + j;
 		}
-		*textlen = strlen(*text);
-		return;
 	}
 
-	index = cs->selected;
-
-	if (index == -1 && p)
-		index = 0;
-	index = cs->selected = (cs->length + (p ? index - 1 : index + 1))
-		% cs->length;
+	return NULL;
+}
+#endif
 
-	n = &cs->completions[cs->selected];
+#if defined(TARGET_AVX2)
+static int avx2;
 
-	free(*text);
-	*text = strdup(n->completion);
-	if (text == NULL) {
-		fprintf(stderr, "Memory allocation error!\n");
-		*status = ERR;
-		return;
+/* Like fsearch_sse2() but with 32 positions at once */
+TARGET_AVX2 static char *
+fsearch_avx2(const char *h, size_t hlen, const char *n, size_t nlen)
+{
+	__m256i first, last, bf, bl;
+	size_t i, j, end;
+	uint32_t m;
+
+	first = _mm256_set1_epi8(n[0]);
+	last = _mm256_set1_epi8(n[nlen - 1]);
+	end = hlen - nlen + 1;
+	for (i = 0; i < end; i += 32) {
+		bf = _mm256_loadu_si256((const __m256i *)(h + i));
+		bl = _mm256_loadu_si256((const __m256i *)(h + i + nlen - 1));
+		m = _mm256_movemask_epi8(_mm256_and_si256(
+		    _mm256_cmpeq_epi8(bf, first), _mm256_cmpeq_epi8(bl, last)));
+		if (end - i < 32)
+			m &= (1U << (end - i)) - 1;
+		for (; m != 0; m &= m - 1) {
+			j = i + __builtin_ctz(m);
+			if (nlen < 3 || memcmp(h + j + 1, n + 1, nlen - 2) == 0)
+				return (char *)h + j;
+		}
 	}
-	*textlen = strlen(*text);
+
+	return NULL;
+}
+#endif
+
+/*
+ * Search the folded query `n' in the folded item `h', that must be
+ * followed by FOLD_PAD readable bytes.  Like memmem(3), returns the
+ * first occurrence or NULL.
+ */
+static char *
+fsearch(const char *h, size_t hlen, const char *n, size_t nlen)
+{
+	if (nlen == 0)
+		return (char *)h;
+	if (hlen < nlen)
+		return NULL;
+
+#if defined(TARGET_AVX2)
+	if (avx2)
+		return fsearch_avx2(h, hlen, n, nlen);
+#endif
+#if defined(__SSE2__)
+	return fsearch_sse2(h, hlen, n, nlen);
+#else
+	return memmem(h, hlen, n, nlen);
+#endif
+}
+
+/* Return the number of online CPUs */
+static int
+ncpus(void)
+{
+	long n;
+
+	if ((n = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		return 1;
+	return MIN(n, MAX_THREADS);
+}
+
+/* The bit for the folded byte `c' in the presence masks */
+static uint64_t
+bytebit(unsigned char c)
+{
+	if (c >= 'a' && c <= 'z')
+		return 1ULL << (c - 'a');
+	if (c >= '0' && c <= '9')
+		return 1ULL << (c - '0' + 26);
+	return 1ULL << (c % 28 + 36);
+}
+
+/*
+ * Return the set of the bytes in `s'.  A text can only contain the
+ * query as a subsequence if it has all the bits of the query, so
+ * most of the items are discarded with a single AND.
+ */
+static uint64_t
+presence(const char *s, size_t len)
+{
+	uint64_t m = 0;
+
+	while (len-- > 0)
+		m |= bytebit(*s++);
+	return m;
+}
+
+/* The bonus for the byte at `i' of `t' if it starts a word */
+static int
+boundary(const char *t, size_t i)
+{
+	unsigned char p, c;
+
+	if (i == 0)
+		return BONUS_BOUNDARY;
+
+	p = t[i - 1];
+	c = t[i];
+	if (!isalnum(p))
+		return BONUS_BOUNDARY;
+	if (islower(p) && isupper(c))
+		return BONUS_CAMEL;
+	return 0;
+}
+
+/*
+ * Find in the folded text `f' the shortest window [*start, *end]
+ * ending at the first full match of the subsequence `q', not empty.
+ * Return 0 if there's none.
+ */
+static int
+fuzzy_window(const char *f, size_t len, const char *q, size_t qlen,
+    size_t *start, size_t *end)
+{
+	size_t i, j;
+
+	for (i = 0, j = 0; i < len; ++i)
+		if (f[i] == q[j] && ++j == qlen)
+			break;
+	if (j < qlen)
+		return 0;
+	*end = i;
+
+	for (j = qlen;; --i)
+		if (f[i] == q[j - 1] && --j == 0)
+			break;
+	*start = i;
+	return 1;
+}
+
+/*
+ * Match the folded query `q' as a subsequence of the folded text `f'
+ * (`t' is the original one) and store its score.  The window found
+ * by fuzzy_window() is scored: every matched byte is worth more at
+ * the start of a word and right after another match, every byte
+ * skipped inside the window costs something.
+ */
+static int
+fuzzy(const char *f, const char *t, size_t len, const char *q, size_t qlen,
+    int *score)
+{
+	size_t i, j, start, end;
+	int s, gap;
+
+	*score = 0;
+	if (qlen == 0)
+		return 1;
+
+	if (!fuzzy_window(f, len, q, qlen, &start, &end))
+		return 0;
+
+	s = 0;
+	gap = 0;
+	for (i = start, j = 0; i <= end; ++i) {
+		if (f[i] != q[j]) {
+			s += gap ? SCORE_GAP : SCORE_GAP_START;
+			gap = 1;
+			continue;
+		}
+
+		s += SCORE_MATCH + boundary(t, i);
+		if (i != start && !gap)
+			s += BONUS_CONSECUTIVE;
+		gap = 0;
+		if (++j == qlen)
+			break;
+	}
+
+	*score = s;
+	return 1;
+}
+
+/* Does the text `t', `len' bytes long, match the regex `re'? */
+static int
+regex_match(const regex_t *re, const char *t, size_t len)
+{
+#ifdef REG_STARTEND
+	regmatch_t m;
+
+	m.rm_so = 0;
+	m.rm_eo = len;
+	return regexec(re, t, 1, &m, REG_STARTEND) == 0;
+#else
+	char *s;
+	int r;
+
+	/* the items are not NUL-terminated */
+	if ((s = strndup(t, len)) == NULL)
+		err(1, "strndup");
+	r = regexec(re, s, 0, NULL, 0) == 0;
+	free(s);
+	return r;
+#endif
+}
+
+/* Does the folded text `f', `len' bytes long, match the word `tk'? */
+static int
+token_match(const struct token *tk, const char *f, size_t len)
+{
+	if (tk->len > len)
+		return 0;
+
+	switch (tk->kind) {
+	case TK_PREFIX:
+		return memcmp(f, tk->s, tk->len) == 0;
+	case TK_SUFFIX:
+		return memcmp(f + len - tk->len, tk->s, tk->len) == 0;
+	case TK_EQUAL:
+		return tk->len == len && memcmp(f, tk->s, len) == 0;
+	default:
+		return fsearch(f, len, tk->s, tk->len) != NULL;
+	}
+}
+
+/*
+ * Does the item with the original text `t', folded `f', and the
+ * presence `mask' matches all the words of cs->query?  `score' is
+ * set for the fuzzy matches, the sum of the scores of the words.
+ * The words are tried in the order of the plan, and the first that
+ * fails stops the search.  With MATCH_REGEX the words are only a
+ * quick test, the regex is run on the items that pass it.
+ */
+static int
+matches(const struct completions *cs, const char *t, const char *f,
+    size_t len, uint64_t mask, int *score)
+{
+	const struct token *tk;
+	size_t i;
+	int s;
+
+	*score = 0;
+	if (cs->mode == MATCH_FUZZY && (mask & cs->qmask) != cs->qmask)
+		return 0;
+
+	for (i = 0; i < cs->nplan; ++i) {
+		if (cs->plan[i] < cs->checked)
+			continue;
+		tk = &cs->tokens[cs->plan[i]];
+		if (tk->neg) {
+			if (token_match(tk, f, len))
+				return 0;
+		} else if (cs->mode == MATCH_FUZZY && tk->kind == TK_WORD) {
+			if (!fuzzy(f, t, len, tk->s, tk->len, &s))
+				return 0;
+			*score += s;
+		} else if (!token_match(tk, f, len))
+			return 0;
+	}
+
+	if (cs->mode == MATCH_REGEX && cs->rx->valid)
+		return regex_match(&cs->rx->re, t, len);
+	return 1;
+}
+
+/* Make room for the words of a query `len' bytes long and drop them */
+static void
+tokens_reset(struct completions *cs, size_t len)
+{
+	if (cs->tokenscap < len / 2 + 1) {
+		void *t;
+
+		t = reallocarray(cs->tokens, len / 2 + 1,
+		    sizeof(struct token));
+		if (t == NULL)
+			err(1, "reallocarray");
+		cs->tokens = t;
+		t = reallocarray(cs->plan, len / 2 + 1, sizeof(size_t));
+		if (t == NULL)
+			err(1, "reallocarray");
+		cs->plan = t;
+		cs->tokenscap = len / 2 + 1;
+	}
+
+	cs->ntokens = 0;
+	cs->nplan = 0;
+	cs->qmask = 0;
+}
+
+static void
+tokens_add(struct completions *cs, const char *s, size_t len,
+    enum token_kind kind, short neg)
+{
+	cs->tokens[cs->ntokens].s = s;
+	cs->tokens[cs->ntokens].len = len;
+	cs->tokens[cs->ntokens].kind = kind;
+	cs->tokens[cs->ntokens].neg = neg;
+	cs->ntokens++;
+	if (!neg)
+		cs->qmask |= presence(s, len);
+}
+
+/* The cost of trying the word `tk', and how likely it is to match */
+static int
+token_cost(const struct completions *cs, const struct token *tk)
+{
+	if (tk->neg)
+		return 5;
+
+	switch (tk->kind) {
+	case TK_EQUAL:
+		return 0;
+	case TK_PREFIX:
+		return 1;
+	case TK_SUFFIX:
+		return 2;
+	case TK_WORD:
+		if (cs->mode == MATCH_FUZZY)
+			return 4;
+		/* FALLTHROUGH */
+	default:
+		return 3;
+	}
+}
+
+/*
+ * Set the order in which matches() tries the words: first the ones
+ * that only compare a few bytes at a known place, then the substrings,
+ * the longest first as they're the rarest, then the fuzzy ones, and
+ * the negations last, as they rarely discard anything.  The operators
+ * alone are left out.
+ */
+static void
+tokens_plan(struct completions *cs)
+{
+	const struct token *a, *b;
+	size_t i, j;
+
+	cs->nplan = 0;
+	for (i = 0; i < cs->ntokens; ++i) {
+		if (cs->tokens[i].kind == TK_NONE)
+			continue;
+
+		a = &cs->tokens[i];
+		for (j = cs->nplan; j > 0; --j) {
+			b = &cs->tokens[cs->plan[j - 1]];
+			if (token_cost(cs, b) < token_cost(cs, a) ||
+			    (token_cost(cs, b) == token_cost(cs, a) &&
+			    b->len >= a->len))
+				break;
+			cs->plan[j] = cs->plan[j - 1];
+		}
+		cs->plan[j] = i;
+		cs->nplan++;
+	}
+}
+
+/*
+ * Split cs->query in its words, separated by spaces, and compute the
+ * presence mask of the ones that must match.  Like fzf(1), a word
+ * starting with `!' must not match, and then one starting with `''
+ * is an exact match, one starting with `^' must be at the start of
+ * the text and one ending with `$' at its end.  Every word is a
+ * token, even without anything left, so the first words_done() ones
+ * are the same for all the queries extending this one.
+ */
+static void
+tokenize(struct completions *cs)
+{
+	enum token_kind kind;
+	const char *q = cs->query;
+	size_t i, j, len = cs->querylen, n;
+	short neg, prefix;
+
+	tokens_reset(cs, len);
+	for (i = 0; i < len; i = j) {
+		while (i < len && q[i] == ' ')
+			++i;
+		for (j = i; j < len && q[j] != ' '; ++j)
+			;
+		if (j == i)
+			break;
+
+		n = j - i;
+		if ((neg = q[i] == '!')) {
+			++i;
+			--n;
+		}
+		if (n > 0 && q[i] == '\'') {
+			++i;
+			--n;
+			kind = TK_EXACT;
+		} else {
+			if ((prefix = n > 0 && q[i] == '^')) {
+				++i;
+				--n;
+			}
+			kind = prefix ? TK_PREFIX : TK_WORD;
+			if (n > 0 && q[i + n - 1] == '$') {
+				--n;
+				kind = prefix ? TK_EQUAL : TK_SUFFIX;
+			}
+		}
+		tokens_add(cs, q + i, n, n == 0 ? TK_NONE : kind, neg);
+	}
+	tokens_plan(cs);
+}
+
+/*
+ * Return the index past the bracket expression of the regex `p' that
+ * starts at `i'.
+ */
+static size_t
+skip_bracket(const char *p, size_t i)
+{
+	char d;
+
+	if (p[++i] == '^')
+		++i;
+	if (p[i] == ']')
+		++i;
+
+	for (; p[i] != '\0' && p[i] != ']'; ++i) {
+		if (p[i] != '[' || (p[i + 1] != ':' && p[i + 1] != '=' &&
+		    p[i + 1] != '.'))
+			continue;
+
+		/* a class like [:alpha:], that can contain a ']' */
+		d = p[i + 1];
+		for (i += 2; p[i] != '\0' && (p[i] != d || p[i + 1] != ']');
+		    ++i)
+			;
+		if (p[i] != '\0')
+			++i;
+	}
+
+	return p[i] == ']' ? i + 1 : i;
+}
+
+/* Like skip_bracket(), but for the group that starts at `i' */
+static size_t
+skip_group(const char *p, size_t i)
+{
+	size_t depth = 0;
+
+	for (; p[i] != '\0'; ++i) {
+		if (p[i] == '\\' && p[i + 1] != '\0')
+			++i;
+		else if (p[i] == '[')
+			i = skip_bracket(p, i) - 1;
+		else if (p[i] == '(')
+			depth++;
+		else if (p[i] == ')' && --depth == 0)
+			return i + 1;
+	}
+
+	return i;
+}
+
+/*
+ * Set the words to the literals that the text must contain to match
+ * the valid extended regex `p', so that most of the items are
+ * discarded by fsearch() before running it.  Only the easy cases are
+ * handled: the runs of ASCII characters outside of the groups and
+ * the bracket expressions, minus the ones made optional by a `*', a
+ * `?' or a `{0'.  With a `|' outside of the groups nothing is needed
+ * for sure.
+ */
+static void
+regex_literals(struct completions *cs, const char *p)
+{
+	size_t i, n = 0, run = 0, len = strlen(p);
+	unsigned char c;
+	char *l;
+	int lit = 0; /* the last atom is the last byte of the run */
+
+	if ((l = realloc(cs->lits, len + 1)) == NULL)
+		err(1, "realloc");
+	cs->lits = l;
+	tokens_reset(cs, len);
+
+	for (i = 0; i < len;) {
+		c = p[i];
+
+		if (c == '|') {
+			cs->ntokens = 0;
+			return;
+		}
+
+		/* an interval the literals can't be sure of */
+		if (c == '{' && !isdigit((unsigned char)p[i + 1]) &&
+		    p[i + 1] != ',') {
+			cs->ntokens = 0;
+			return;
+		}
+
+		if (c == '*' || c == '?' || c == '+' || c == '{') {
+			/* a quantifier, of the last atom; {,n} is {0,n} */
+			if (lit && (c == '*' || c == '?' || (c == '{' &&
+			    strtoul(p + i + 1, NULL, 10) == 0)))
+				n--;
+			if (n > run)
+				tokens_add(cs, l + run, n - run, TK_WORD, 0);
+			run = n;
+			lit = 0;
+
+			if (c == '{')
+				while (i < len && p[i] != '}')
+					++i;
+			++i;
+			continue;
+		}
+
+		/* \<, \>, \` and \' are anchors, that match no byte */
+		if (c == '\\' && i + 1 < len &&
+		    (unsigned char)p[i + 1] < 0x80 && ispunct(p[i + 1]) &&
+		    strchr("<>`'", p[i + 1]) == NULL) {
+			l[n++] = p[i + 1];
+			lit = 1;
+			i += 2;
+			continue;
+		}
+
+		if (c < 0x80 && strchr("^.[$()\\{", c) == NULL) {
+			l[n++] = c;
+			lit = 1;
+			++i;
+			continue;
+		}
+
+		/* anything else ends the run */
+		if (n > run)
+			tokens_add(cs, l + run, n - run, TK_WORD, 0);
+		run = n;
+		lit = 0;
+
+		if (c == '[')
+			i = skip_bracket(p, i);
+		else if (c == '(')
+			i = skip_group(p, i);
+		else if (c == '\\')
+			i += 2;
+		else
+			++i;
+	}
+
+	if (n > run)
+		tokens_add(cs, l + run, n - run, TK_WORD, 0);
+
+	/* they're searched in the folded items */
+	fold(l, l, n);
+	cs->qmask = 0;
+	for (i = 0; i < cs->ntokens; ++i)
+		cs->qmask |= presence(cs->tokens[i].s, cs->tokens[i].len);
+}
+
+/*
+ * Return the regex compiled from `pattern', from the cache of the
+ * last REGEX_CACHE ones.
+ */
+static struct regex *
+regex_get(struct completions *cs, const char *pattern)
+{
+	struct regex *r, *lru = NULL;
+	size_t i;
+
+	for (i = 0; i < cs->nregexes; ++i) {
+		r = &cs->regexes[i];
+		if (!strcmp(r->pattern, pattern)) {
+			r->used = ++cs->rxclock;
+			return r;
+		}
+		if (lru == NULL || r->used < lru->used)
+			lru = r;
+	}
+
+	if (cs->nregexes < REGEX_CACHE)
+		r = &cs->regexes[cs->nregexes++];
+	else {
+		r = lru;
+		free(r->pattern);
+		if (r->valid)
+			regfree(&r->re);
+	}
+
+	if ((r->pattern = strdup(pattern)) == NULL)
+		err(1, "strdup");
+	r->valid = regcomp(&r->re, pattern,
+	    REG_EXTENDED | REG_ICASE | REG_NOSUB) == 0;
+	r->used = ++cs->rxclock;
+	return r;
+}
+
+/*
+ * Prepare the regex for the query `text'.  While it's not valid, as
+ * it happens while it's typed, the text is matched as it is.
+ */
+static void
+regex_query(struct completions *cs, const char *text)
+{
+	cs->rx = regex_get(cs, text);
+	if (cs->rx->valid)
+		regex_literals(cs, text);
+	else {
+		tokens_reset(cs, cs->querylen);
+		if (cs->querylen != 0)
+			tokens_add(cs, cs->query, cs->querylen, TK_WORD, 0);
+	}
+	tokens_plan(cs);
+}
+
+/*
+ * Return how many words of the query `q' are followed by a space:
+ * they can't change when the query is extended.
+ */
+static size_t
+words_done(const char *q, size_t len)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i + 1 < len; ++i)
+		if (q[i] != ' ' && q[i + 1] == ' ')
+			n++;
+	return n;
+}
+
+/* Return the length of the longest word of cs->query that must match */
+static size_t
+longest_token(const struct completions *cs)
+{
+	size_t i, max = 0;
+
+	for (i = 0; i < cs->ntokens; ++i)
+		if (!cs->tokens[i].neg)
+			max = MAX(max, cs->tokens[i].len);
+	return max;
+}
+
+static void
+mark_add(struct completions *cs, size_t start, size_t end)
+{
+	if (cs->nmarks == cs->markscap) {
+		size_t newcap;
+		void *t;
+
+		newcap = MAX(cs->markscap * 2, 64);
+		t = reallocarray(cs->marks, newcap, sizeof(struct mark));
+		if (t == NULL)
+			err(1, "reallocarray");
+		cs->marks = t;
+		cs->markscap = newcap;
+	}
+
+	cs->marks[cs->nmarks].start = start;
+	cs->marks[cs->nmarks].end = end;
+	cs->nmarks++;
+}
+
+/* Remember that the marks of the index-th item start at `first' */
+static void
+marked_add(struct completions *cs, uint32_t index, size_t first)
+{
+	if (cs->nmarked == cs->markedcap) {
+		size_t newcap;
+		void *t;
+
+		newcap = MAX(cs->markedcap * 2, 32);
+		t = reallocarray(cs->marked, newcap, sizeof(struct marked));
+		if (t == NULL)
+			err(1, "reallocarray");
+		cs->marked = t;
+		cs->markedcap = newcap;
+	}
+
+	cs->marked[cs->nmarked].index = index;
+	cs->marked[cs->nmarked].first = first;
+	cs->marked[cs->nmarked].n = cs->nmarks - first;
+	cs->nmarked++;
+}
+
+static int
+cmp_mark(const void *a, const void *b)
+{
+	const struct mark *ma = a, *mb = b;
+
+	return ma->start < mb->start ? -1 : ma->start > mb->start;
+}
+
+/*
+ * Add the marks for the folded text `f', `len' bytes long, that
+ * matches the words of the query: where the first occurrence of
+ * every substring is, or the bytes picked by fuzzy_window().  The
+ * regexes only mark their literals.  They're sorted, merged and
+ * widened to whole UTF-8 characters.
+ */
+static void
+marks_find(struct completions *cs, const char *f, size_t len)
+{
+	const struct token *tk;
+	const char *p;
+	size_t i, j, k, start, end, first = cs->nmarks;
+	struct mark *m;
+
+	for (i = 0; i < cs->ntokens; ++i) {
+		tk = &cs->tokens[i];
+		if (tk->neg || tk->kind == TK_NONE || tk->len > len)
+			continue;
+
+		switch (tk->kind) {
+		case TK_PREFIX:
+		case TK_EQUAL:
+			mark_add(cs, 0, tk->len);
+			break;
+		case TK_SUFFIX:
+			mark_add(cs, len - tk->len, len);
+			break;
+		case TK_WORD:
+			if (cs->mode == MATCH_FUZZY) {
+				if (!fuzzy_window(f, len, tk->s, tk->len,
+				    &start, &end))
+					break;
+				for (j = 0, k = start; k <= end && j < tk->len;
+				    ++k)
+					if (f[k] == tk->s[j]) {
+						mark_add(cs, k, k + 1);
+						j++;
+					}
+				break;
+			}
+			/* FALLTHROUGH */
+		default:
+			if ((p = fsearch(f, len, tk->s, tk->len)) != NULL)
+				mark_add(cs, p - f, p - f + tk->len);
+			break;
+		}
+	}
+
+	m = cs->marks + first;
+	qsort(m, cs->nmarks - first, sizeof(*m), cmp_mark);
+	for (i = 0, j = 0; i < cs->nmarks - first; ++i) {
+		while (m[i].start > 0 &&
+		    ((unsigned char)f[m[i].start] & 0xc0) == 0x80)
+			m[i].start--;
+		while (m[i].end < len &&
+		    ((unsigned char)f[m[i].end] & 0xc0) == 0x80)
+			m[i].end++;
+
+		if (j > 0 && m[i].start <= m[j - 1].end)
+			m[j - 1].end = MAX(m[j - 1].end, m[i].end);
+		else
+			m[j++] = m[i];
+	}
+	cs->nmarks = first + j;
+}
+
+/* Return the text to match and show of the index-th item */
+static char *
+item_text(const struct items *items, size_t index, size_t *len)
+{
+	char *l;
+
+	l = items->lines[index];
+	*len = items->lens[index];
+	if (items->vlines != NULL) {
+		l = items->vlines[index];
+		*len -= l - items->lines[index];
+	}
+	return l;
+}
+
+/*
+ * Return the marks of the index-th item, and how many they are in
+ * `*n'.  They're found the first time it's drawn and then kept until
+ * the query changes, or until there are too many.  The pointer is
+ * valid until the next call.
+ */
+static const struct mark *
+marks_get(struct completions *cs, uint32_t index, size_t *n)
+{
+	struct marked *md;
+	size_t i, len;
+
+	for (i = 0; i < cs->nmarked; ++i) {
+		md = &cs->marked[i];
+		if (md->index == index) {
+			*n = md->n;
+			return cs->marks + md->first;
+		}
+	}
+
+	if (cs->nmarked == MARKS_MAX)
+		cs->nmarked = cs->nmarks = 0;
+
+	i = cs->nmarks;
+	item_text(cs->items, index, &len);
+	marks_find(cs, cs->items->folded[index], len);
+	marked_add(cs, index, i);
+	*n = cs->nmarks - i;
+	return cs->marks + i;
+}
+
+/*
+ * Make the index-th item the n-th completion of `out', and store its
+ * score, with the one from the history, if `scores' isn't NULL.
+ */
+static void
+compl_set(const struct items *items, uint32_t *out, int *scores, size_t n,
+    size_t index, int score)
+{
+	out[n] = index;
+	if (scores == NULL)
+		return;
+	if (items->frec != NULL)
+		score += items->frec[index];
+	scores[n] = score;
+}
+
+/*
+ * Store at `out' the completions for the items in [start, end) that
+ * match cs->query, and at `scores' their scores if not NULL, and
+ * return how many they are.
+ */
+static size_t
+match_items(const struct completions *cs, const struct items *items,
+    size_t start, size_t end, uint32_t *out, int *scores)
+{
+	size_t index, len, n = 0;
+	uint64_t mask;
+	char *l;
+	int score;
+
+	for (index = start; index < end; ++index) {
+		l = item_text(items, index, &len);
+		mask = items->masks != NULL ? items->masks[index] : 0;
+		if (matches(cs, l, items->folded[index], len, mask, &score))
+			compl_set(items, out, scores, n++, index, score);
+	}
+
+	return n;
+}
+
+/*
+ * Like match_items() but for the completions in [start, end) of
+ * `from'.  `out' may be `from + start'.
+ */
+static size_t
+match_compls(const struct completions *cs, const struct items *items,
+    const uint32_t *from, size_t start, size_t end, uint32_t *out,
+    int *scores)
+{
+	size_t i, len, n = 0;
+	uint64_t mask;
+	uint32_t index;
+	char *l;
+	int score;
+
+	for (i = start; i < end; ++i) {
+		index = from[i];
+		l = item_text(items, index, &len);
+		mask = items->masks != NULL ? items->masks[index] : 0;
+		if (matches(cs, l, items->folded[index], len, mask, &score))
+			compl_set(items, out, scores, n++, index, score);
+	}
+
+	return n;
+}
+
+#if HAVE_PTHREAD
+struct match_job {
+	pthread_t th;
+	int started;
+	const struct completions *cs;
+	const struct items *items;
+	const uint32_t *from; /* NULL when matching the items */
+	size_t start;
+	size_t end;
+	uint32_t *out;
+	int *scores;
+	size_t len;
+};
+
+static void *
+match_worker(void *arg)
+{
+	struct match_job *job = arg;
+
+	if (job->from == NULL)
+		job->len = match_items(job->cs, job->items, job->start,
+		    job->end, job->out, job->scores);
+	else
+		job->len = match_compls(job->cs, job->items, job->from,
+		    job->start, job->end, job->out, job->scores);
+	return NULL;
+}
+#endif
+
+/*
+ * Store at `out' the matching items, or completions of `from' if not
+ * NULL, in [start, end), and their scores at `scores' if not NULL,
+ * and return how many they are.
+ * `out' must have room for all of them.  Big ranges are split among
+ * threads: every piece is written at its own offset of `out' and
+ * then moved after the previous one, so the result is in the same
+ * order the serial loop would give.
+ */
+static size_t
+match(const struct completions *cs, const struct items *items,
+    const uint32_t *from, size_t start, size_t end, uint32_t *out,
+    int *scores)
+{
+#if HAVE_PTHREAD
+	struct match_job *jobs;
+	size_t piece, n;
+	int i, nth;
+
+	nth = ncpus();
+	if (end - start < PARALLEL_MATCH_MIN || nth < 2)
+		goto serial;
+
+	if ((jobs = calloc(nth, sizeof(*jobs))) == NULL)
+		err(1, "calloc");
+
+	piece = (end - start) / nth;
+	for (i = 0; i < nth; ++i) {
+		jobs[i].cs = cs;
+		jobs[i].items = items;
+		jobs[i].from = from;
+		jobs[i].start = start + i * piece;
+		jobs[i].end = i == nth - 1 ? end : jobs[i].start + piece;
+		jobs[i].out = out + i * piece;
+		jobs[i].scores = scores != NULL ? scores + i * piece : NULL;
+
+		/* the first piece is done by this thread */
+		if (i != 0)
+			jobs[i].started = pthread_create(&jobs[i].th, NULL,
+			    match_worker, &jobs[i]) == 0;
+	}
+
+	n = 0;
+	for (i = 0; i < nth; ++i) {
+		if (jobs[i].started)
+			pthread_join(jobs[i].th, NULL);
+		else
+			match_worker(&jobs[i]);
+
+		if (jobs[i].out != out + n) {
+			memmove(out + n, jobs[i].out,
+			    jobs[i].len * sizeof(*out));
+			if (scores != NULL)
+				memmove(scores + n, jobs[i].scores,
+				    jobs[i].len * sizeof(*scores));
+		}
+		n += jobs[i].len;
+	}
+
+	free(jobs);
+	return n;
+
+serial:
+#endif
+	if (from == NULL)
+		return match_items(cs, items, start, end, out, scores);
+	return match_compls(cs, items, from, start, end, out, scores);
+}
+
+/* A completion being ranked, with what it's ranked by */
+struct ranked {
+	uint32_t index;
+	uint32_t len;
+	int score;
+	uint32_t pos; /* in the completions */
+};
+
+/* Is `a' a better match than `b'? */
+static int
+better(const struct ranked *a, const struct ranked *b)
+{
+	if (a->score != b->score)
+		return a->score > b->score;
+	if (a->len != b->len)
+		return a->len < b->len;
+	return a->index < b->index;
+}
+
+static int
+cmp_rank(const void *a, const void *b)
+{
+	return better(a, b) ? -1 : 1;
+}
+
+static int
+cmp_index(const void *a, const void *b)
+{
+	const struct ranked *ra = a, *rb = b;
+
+	return ra->index < rb->index ? -1 : 1;
+}
+
+/* The p-th completion, to be ranked */
+static struct ranked
+ranked_get(const struct completions *cs, const struct items *items,
+    size_t p)
+{
+	struct ranked r;
+	size_t len;
+
+	r.index = cs->completions[p];
+	item_text(items, r.index, &len);
+	r.len = len;
+	r.score = cs->scores[p];
+	r.pos = p;
+	return r;
+}
+
+/*
+ * Move the best FUZZY_TOP completions, sorted, at the start of the
+ * list, and the rest after them in the order of the items.  They're
+ * found with a heap whose root is the worst of the ones kept so far,
+ * so it's a single comparison for most of the completions.  The
+ * completions after cs->ranked are already in order, only the ones
+ * that were ranked before need to be sorted and merged with them.
+ * Outside of MATCH_FUZZY only the ones with a score, from the
+ * history, are ranked.
+ */
+static void
+rank(struct completions *cs, const struct items *items)
+{
+	uint32_t *c = cs->completions;
+	int *s = cs->scores;
+	struct ranked *heap, *pre, r;
+	size_t n, k, nh, npre, i, j, o, p, t;
+
+	n = cs->length;
+	if (n == 0) {
+		cs->ranked = 0;
+		return;
+	}
+
+	k = MIN(n, FUZZY_TOP);
+	if ((heap = calloc(k + cs->ranked, sizeof(*heap))) == NULL)
+		err(1, "calloc");
+	pre = heap + k;
+
+	for (p = 0, nh = 0; p < n; ++p) {
+		if (cs->mode != MATCH_FUZZY && s[p] <= 0)
+			continue;
+		/* most are worse than the root by the score alone */
+		if (nh == k && s[p] < heap[0].score)
+			continue;
+		r = ranked_get(cs, items, p);
+		if (nh < k) {
+			for (i = nh++; i > 0; i = j) {
+				j = (i - 1) / 2;
+				if (!better(&heap[j], &r))
+					break;
+				heap[i] = heap[j];
+			}
+			heap[i] = r;
+		} else if (better(&r, &heap[0])) {
+			for (i = 0; (j = 2 * i + 1) < nh; i = j) {
+				if (j + 1 < nh && better(&heap[j],
+				    &heap[j + 1]))
+					j++;
+				if (!better(&r, &heap[j]))
+					break;
+				heap[i] = heap[j];
+			}
+			heap[i] = r;
+		}
+	}
+
+	/* take out the best ones, marking their slot */
+	for (i = 0; i < nh; ++i)
+		c[heap[i].pos] = UINT32_MAX;
+	qsort(heap, nh, sizeof(*heap), cmp_rank);
+
+	for (p = 0, npre = 0; p < cs->ranked; ++p)
+		if (c[p] != UINT32_MAX)
+			pre[npre++] = ranked_get(cs, items, p);
+	qsort(pre, npre, sizeof(*pre), cmp_index);
+
+	for (p = cs->ranked, t = 0; p < n; ++p) {
+		if (c[p] != UINT32_MAX) {
+			c[t] = c[p];
+			s[t++] = s[p];
+		}
+	}
+
+	/* move the rest at the end and merge `pre' into it */
+	memmove(c + n - t, c, t * sizeof(*c));
+	memmove(s + n - t, s, t * sizeof(*s));
+	for (i = 0, j = n - t, o = nh; i < npre; ++o) {
+		if (j < n && c[j] < pre[i].index) {
+			c[o] = c[j];
+			s[o] = s[j++];
+		} else {
+			c[o] = pre[i].index;
+			s[o] = pre[i++].score;
+		}
+	}
+
+	for (i = 0; i < nh; ++i) {
+		c[i] = heap[i].index;
+		s[i] = heap[i].score;
+	}
+	cs->ranked = nh;
+
+	free(heap);
+}
+
+/* The posting list of the trigram at `s' */
+static uint32_t
+trigram(const char *s)
+{
+	uint32_t t;
+
+	t = (unsigned char)s[0] << 16 | (unsigned char)s[1] << 8 |
+	    (unsigned char)s[2];
+	return (t * 2654435761U) >> (32 - TRIGRAM_BITS);
+}
+
+/*
+ * Build the trigram index of the items.  The lists are counted first,
+ * so that they can be stored one after the other in a single array,
+ * and then filled; `last' remembers the last item added to every
+ * list, so the trigrams repeated in an item are added only once.
+ */
+static void
+index_build(struct items *items)
+{
+	struct trigrams *tri;
+	uint32_t *last, h;
+	size_t *pos, i, j, len, n;
+	const char *f;
+
+	if ((tri = calloc(1, sizeof(*tri))) == NULL)
+		err(1, "calloc");
+	if ((tri->offs = calloc(TRIGRAM_LISTS + 1, sizeof(size_t))) == NULL)
+		err(1, "calloc");
+	if ((last = calloc(TRIGRAM_LISTS, sizeof(uint32_t))) == NULL)
+		err(1, "calloc");
+	memset(last, 0xff, TRIGRAM_LISTS * sizeof(uint32_t));
+
+	for (i = 0; i < items->len; ++i) {
+		f = items->folded[i];
+		item_text(items, i, &len);
+		for (j = 0; j + 3 <= len; ++j) {
+			h = trigram(f + j);
+			if (last[h] != i) {
+				last[h] = i;
+				tri->offs[h + 1]++;
+			}
+		}
+	}
+
+	for (h = 0; h < TRIGRAM_LISTS; ++h)
+		tri->offs[h + 1] += tri->offs[h];
+	n = tri->offs[TRIGRAM_LISTS];
+
+	if ((tri->posts = calloc(MAX(n, 1), sizeof(uint32_t))) == NULL)
+		err(1, "calloc");
+	if ((pos = calloc(TRIGRAM_LISTS, sizeof(size_t))) == NULL)
+		err(1, "calloc");
+	memcpy(pos, tri->offs, TRIGRAM_LISTS * sizeof(size_t));
+	memset(last, 0xff, TRIGRAM_LISTS * sizeof(uint32_t));
+
+	for (i = 0; i < items->len; ++i) {
+		f = items->folded[i];
+		item_text(items, i, &len);
+		for (j = 0; j + 3 <= len; ++j) {
+			h = trigram(f + j);
+			if (last[h] != i) {
+				last[h] = i;
+				tri->posts[pos[h]++] = i;
+			}
+		}
+	}
+
+	free(pos);
+	free(last);
+
+	tri->nitems = items->len;
+	items->tri = tri;
+}
+
+static void
+index_free(struct trigrams *tri)
+{
+	if (tri == NULL)
+		return;
+
+	free(tri->offs);
+	free(tri->posts);
+	free(tri);
+}
+
+/*
+ * Can the items in [from, end) be filtered with the index for a query
+ * whose longest word is `longest' bytes?  At least one word needs a
+ * trigram.
+ */
+static int
+index_usable(const struct completions *cs, const struct items *items,
+    size_t longest, size_t end)
+{
+	return items->tri != NULL && cs->mode != MATCH_FUZZY &&
+	    end <= items->tri->nitems && longest >= 3;
+}
+
+/*
+ * Move `*p' forward to the first posting of the list `l', `n' long,
+ * that is not less than `id', and return whether it is `id'.  The
+ * steps double until they go past it and then it's a binary search,
+ * so skipping a lot is cheap too.
+ */
+static int
+gallop(const uint32_t *l, size_t n, size_t *p, uint32_t id)
+{
+	size_t lo, hi, mid, step;
+
+	lo = *p;
+	if (lo >= n || l[lo] >= id)
+		return lo < n && l[lo] == id;
+
+	/* here l[lo] < id */
+	for (step = 1, hi = lo + 1; hi < n && l[hi] < id; step *= 2) {
+		lo = hi;
+		hi = lo + step;
+	}
+	hi = MIN(hi, n);
+
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (l[mid] < id)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	*p = hi;
+	return hi < n && l[hi] == id;
+}
+
+struct plist {
+	const uint32_t *l;
+	size_t n;
+	size_t p;
+};
+
+static int
+cmp_plist(const void *a, const void *b)
+{
+	const struct plist *pa = a, *pb = b;
+
+	return pa->n < pb->n ? -1 : pa->n > pb->n;
+}
+
+/*
+ * Like match_items(), but only the items in all the posting lists of
+ * the trigrams of the words of the query that must match are looked
+ * at.  The shortest list is walked and the others are searched with
+ * gallop().  The survivors still need to be checked, as the lists are
+ * shared by the trigrams with the same hash and the order of the
+ * trigrams is lost, and for the words too short to have one.
+ */
+static size_t
+index_match(const struct completions *cs, const struct items *items,
+    size_t start, size_t end, uint32_t *out, int *scores)
+{
+	const struct trigrams *tri = items->tri;
+	const struct token *tk;
+	struct plist *pl;
+	size_t i, j, k, nl = 0, len, n = 0;
+	uint32_t id, h;
+	char *l;
+	int score;
+
+	for (k = 0; k < cs->ntokens; ++k)
+		if (!cs->tokens[k].neg && cs->tokens[k].len >= 3)
+			nl += cs->tokens[k].len - 2;
+	if ((pl = calloc(nl, sizeof(*pl))) == NULL)
+		err(1, "calloc");
+
+	for (k = 0, i = 0; k < cs->ntokens; ++k) {
+		tk = &cs->tokens[k];
+		if (tk->neg)
+			continue;
+		for (j = 0; j + 2 < tk->len; ++j, ++i) {
+			h = trigram(tk->s + j);
+			pl[i].l = tri->posts + tri->offs[h];
+			pl[i].n = tri->offs[h + 1] - tri->offs[h];
+			pl[i].p = 0;
+			gallop(pl[i].l, pl[i].n, &pl[i].p, start);
+		}
+	}
+	qsort(pl, nl, sizeof(*pl), cmp_plist);
+
+	for (i = pl[0].p; i < pl[0].n && (id = pl[0].l[i]) < end; ++i) {
+		for (j = 1; j < nl; ++j)
+			if (!gallop(pl[j].l, pl[j].n, &pl[j].p, id))
+				break;
+		if (j != nl)
+			continue;
+
+		l = item_text(items, id, &len);
+		if (matches(cs, l, items->folded[id], len, 0, &score))
+			compl_set(items, out, scores, n++, id, score);
+	}
+
+	free(pl);
+	return n;
+}
+
+struct sortkey {
+	const char *f;
+	uint32_t len;
+	uint32_t index;
+};
+
+static int
+cmp_sortkey(const void *a, const void *b)
+{
+	const struct sortkey *ka = a, *kb = b;
+	int c;
+
+	if ((c = memcmp(ka->f, kb->f, MIN(ka->len, kb->len))) != 0)
+		return c;
+	return ka->len < kb->len ? -1 : ka->len > kb->len;
+}
+
+/*
+ * Sort the indexes of the items by their folded text in
+ * items->sorted, so that the items starting with the same text are
+ * next to each other.
+ */
+static void
+sorted_build(struct items *items)
+{
+	struct sortkey *k;
+	size_t i, len;
+
+	if ((k = calloc(MAX(items->len, 1), sizeof(*k))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < items->len; ++i) {
+		item_text(items, i, &len);
+		k[i].f = items->folded[i];
+		k[i].len = len;
+		k[i].index = i;
+	}
+	qsort(k, items->len, sizeof(*k), cmp_sortkey);
+
+	if ((items->sorted = calloc(MAX(items->len, 1), sizeof(uint32_t)))
+	    == NULL)
+		err(1, "calloc");
+	for (i = 0; i < items->len; ++i)
+		items->sorted[i] = k[i].index;
+	free(k);
+}
+
+/*
+ * Compare the folded text `f', `len' bytes long, with the prefix `p':
+ * 0 if it starts with it.
+ */
+static int
+prefix_cmp(const char *f, size_t len, const char *p, size_t plen)
+{
+	int c;
+
+	if ((c = memcmp(f, p, MIN(len, plen))) != 0)
+		return c;
+	return len < plen ? -1 : 0;
+}
+
+/*
+ * Return the first position of items->sorted, from `lo', whose item
+ * is not before `tk' or, if `past', doesn't start with it either.
+ */
+static size_t
+sorted_search(const struct items *items, const struct token *tk,
+    size_t lo, int past)
+{
+	size_t hi = items->len, mid, len;
+	uint32_t id;
+	int c;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		id = items->sorted[mid];
+		item_text(items, id, &len);
+		c = prefix_cmp(items->folded[id], len, tk->s, tk->len);
+		if (c < 0 || (past && c == 0))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * If a word of the query must be at the start of the items, set
+ * [*lo, *hi) to the range of items->sorted that start with it, the
+ * shortest one if there are more such words, and return 1.  The
+ * items are sorted the first time, but only if they're all read and
+ * the index was asked for.
+ */
+static int
+prefix_range(const struct completions *cs, struct items *items,
+    size_t *lo, size_t *hi)
+{
+	const struct token *tk;
+	size_t i, l, h;
+	int found = 0;
+
+	if (!items->use_index || items->fd != -1 || cs->mode == MATCH_REGEX)
+		return 0;
+
+	for (i = 0; i < cs->ntokens; ++i) {
+		tk = &cs->tokens[i];
+		if (tk->neg || (tk->kind != TK_PREFIX && tk->kind != TK_EQUAL))
+			continue;
+
+		if (items->sorted == NULL)
+			sorted_build(items);
+		l = sorted_search(items, tk, 0, 0);
+		h = sorted_search(items, tk, l, 1);
+		if (!found || h - l < *hi - *lo) {
+			*lo = l;
+			*hi = h;
+			found = 1;
+		}
+	}
+
+	return found;
+}
+
+static int
+cmp_id(const void *a, const void *b)
+{
+	uint32_t ia = *(const uint32_t *)a, ib = *(const uint32_t *)b;
+
+	return ia < ib ? -1 : ia > ib;
+}
+
+/*
+ * Like match_items(), but only the items in [lo, hi) of
+ * items->sorted, the ones that start with a word of the query, are
+ * looked at.  They're put back in the order of the items first.
+ */
+static size_t
+sorted_match(const struct completions *cs, const struct items *items,
+    size_t lo, size_t hi, size_t start, size_t end, uint32_t *out,
+    int *scores)
+{
+	uint32_t *ids, id;
+	size_t i, len, nids = 0, n = 0;
+	uint64_t mask;
+	char *l;
+	int score;
+
+	if ((ids = calloc(MAX(hi - lo, 1), sizeof(uint32_t))) == NULL)
+		err(1, "calloc");
+	for (i = lo; i < hi; ++i)
+		if (items->sorted[i] >= start && items->sorted[i] < end)
+			ids[nids++] = items->sorted[i];
+	qsort(ids, nids, sizeof(uint32_t), cmp_id);
+
+	for (i = 0; i < nids; ++i) {
+		id = ids[i];
+		l = item_text(items, id, &len);
+		mask = items->masks != NULL ? items->masks[id] : 0;
+		if (matches(cs, l, items->folded[id], len, mask, &score))
+			compl_set(items, out, scores, n++, id, score);
+	}
+
+	free(ids);
+	return n;
+}
+
+/* Compute the presence masks of the items that still miss them */
+static void
+items_masks(struct items *items)
+{
+	size_t i, len;
+	void *t;
+
+	if (items->nmasks == items->len)
+		return;
+
+	t = reallocarray(items->masks, items->cap, sizeof(uint64_t));
+	if (t == NULL)
+		err(1, "reallocarray");
+	items->masks = t;
+
+	for (i = items->nmasks; i < items->len; ++i) {
+		item_text(items, i, &len);
+		items->masks[i] = presence(items->folded[i], len);
+	}
+	items->nmasks = items->len;
+}
+
+/*
+ * Append to the completion list the items in [cs->nitems, end) that
+ * matches cs->query.  The completions are always the matching items
+ * among the first cs->nitems, the others are filtered lazily.  When
+ * a word must be at the start of the items and only a few of them
+ * start with it, they're all filtered at once from the sorted items,
+ * else with the index, if possible, or by looking at them all.
+ */
+static void
+filter(struct completions *cs, struct items *items, size_t end)
+{
+	size_t from = cs->nitems, lo = 0, hi = 0, n;
+	uint32_t *out;
+	int sorted, *scores;
+
+	if (cs->mode == MATCH_FUZZY)
+		items_masks(items);
+
+	sorted = prefix_range(cs, items, &lo, &hi) &&
+	    (hi - lo) * 8 < items->len - from;
+	if (sorted)
+		end = items->len;
+	n = sorted ? hi - lo : end - from;
+
+	compls_reserve(cs, cs->length + n);
+	out = cs->completions + cs->length;
+	scores = cs->scores != NULL ? cs->scores + cs->length : NULL;
+
+	if (sorted)
+		cs->length += sorted_match(cs, items, lo, hi, from, end,
+		    out, scores);
+	else if (index_usable(cs, items, longest_token(cs), end))
+		cs->length += index_match(cs, items, from, end, out, scores);
+	else
+		cs->length += match(cs, items, NULL, from, end, out, scores);
+	cs->nitems = end;
+
+	if (compls_scored(cs) && from != end)
+		rank(cs, items);
+}
+
+/*
+ * Is the job the worker is running stale?  Always false when `w' is
+ * NULL, i.e. when filtering from the event loop.
+ */
+static int
+worker_stale(struct worker *w)
+{
+	int stale = 0;
+
+#if HAVE_PTHREAD
+	if (w != NULL && w->started) {
+		pthread_mutex_lock(&w->mtx);
+		stale = w->gen != w->jobgen;
+		pthread_mutex_unlock(&w->mtx);
+	}
+#endif
+	return stale;
+}
+
+/*
+ * Filter the items not looked at yet until there are at least `want'
+ * completions.  The first step is LAZY_STEP items and every other is
+ * twice the previous, so it stops early when the matches are common
+ * and the rare ones are still searched with big, threaded, steps.
+ * When run by the worker `w' it stops between two steps if the query
+ * became stale: the completions are still valid, only incomplete.
+ */
+static void
+fill(struct completions *cs, struct items *items, size_t want,
+    struct worker *w)
+{
+	size_t step;
+
+	for (step = LAZY_STEP; cs->length < want && cs->nitems < items->len &&
+	    !worker_stale(w); step = MIN(step * 2, FILL_STEP_MAX))
+		filter(cs, items, MIN(cs->nitems + step, items->len));
+}
+
+/*
+ * Set the completions to the ones in `from' (`len' long, the first
+ * `ranked' of them ranked) that match cs->query.  Only valid if the
+ * query extends the one used to filter them.  `from' may be
+ * cs->completions itself.  The unranked ones are done first, so that
+ * they're stored in the same place they are read from, then the
+ * ranked ones are put before them.  The first `known' words of the
+ * query are the same of the old one, so they're not searched again,
+ * unless they're needed for the fuzzy scores.
+ */
+static void
+narrow(struct completions *cs, struct items *items, const uint32_t *from,
+    size_t len, size_t ranked, size_t known)
+{
+	uint32_t *c;
+	int *s;
+	size_t n;
+
+	if (cs->mode == MATCH_SUBSTRING)
+		cs->checked = known;
+
+	/* `from' is either a snapshot or fits already */
+	compls_reserve(cs, len);
+	c = cs->completions;
+	s = cs->scores;
+
+	n = match(cs, items, from, ranked, len, c + ranked,
+	    s != NULL ? s + ranked : NULL);
+	cs->ranked = match(cs, items, from, 0, ranked, c, s);
+	memmove(c + cs->ranked, c + ranked, n * sizeof(*c));
+	if (s != NULL)
+		memmove(s + cs->ranked, s + ranked, n * sizeof(*s));
+	cs->length = cs->ranked + n;
+	cs->checked = 0;
+
+	if (compls_scored(cs))
+		rank(cs, items);
+}
+
+/* Is `q' a prefix of `text'? */
+static int
+is_prefix(const char *q, size_t qlen, const char *text, size_t len)
+{
+	return qlen <= len && memcmp(text, q, qlen) == 0;
+}
+
+/*
+ * Are the items matching the query `q' among the ones matching `old'?
+ * It needs to be a prefix of it, and if its last word is extended it
+ * can't be a negation, or have a `$' at the end, as the new word may
+ * discard less.
+ */
+static int
+narrows(const char *old, size_t oldlen, const char *q, size_t len)
+{
+	size_t i;
+
+	if (!is_prefix(old, oldlen, q, len))
+		return 0;
+	if (oldlen == 0 || oldlen == len || old[oldlen - 1] == ' ' ||
+	    q[oldlen] == ' ')
+		return 1;
+
+	for (i = oldlen; i > 0 && old[i - 1] != ' '; --i)
+		;
+	return old[i] != '!' && old[oldlen - 1] != '$';
+}
+
+/*
+ * Update the given completion.  When the text only grows every item
+ * that may match is usually already in the list, see narrows(), so
+ * only the current completions are filtered again and the previous
+ * ones are kept as a snapshot.  When it shrinks the snapshot for the
+ * longest prefix of the text is restored and, if needed, narrowed.
+ * Only when there's none, or when the trigram index can be used, all
+ * the items are filtered again.  Either way, only
+ * the items needed to have `want' completions are looked at: the
+ * others are left for later, see loop().  `w' is the worker running
+ * the update, if any.
+ */
+static void
+update_completions(struct completions *cs, char *text, struct items *items,
+    short first_selected, size_t want, struct worker *w)
+{
+	struct snapshot *s;
+	char *query;
+	size_t len, known;
+	int full, same, snap;
+
+	len = strlen(text);
+	if ((query = malloc(len + 1)) == NULL)
+		err(1, "malloc");
+	fold(query, text, len + 1);
+
+	cs->nmarks = 0;
+	cs->nmarked = 0;
+	cs->marksgen++;
+
+	while (cs->nsnaps > 0) {
+		s = &cs->snaps[cs->nsnaps - 1];
+		if (narrows(s->query, s->querylen, query, len))
+			break;
+		snap_drop(cs, cs->nsnaps - 1);
+	}
+
+	if (cs->query != NULL &&
+	    !narrows(cs->query, cs->querylen, query, len) &&
+	    cs->nsnaps > 0)
+		snap_pop(cs);
+
+	full = cs->query == NULL ||
+	    !narrows(cs->query, cs->querylen, query, len);
+	same = !full && cs->querylen == len;
+	/* a regex that grows can match more */
+	if (cs->mode == MATCH_REGEX) {
+		same = same && !strcmp(cs->rx->pattern, text);
+		full = !same;
+	}
+	known = full ? 0 : words_done(cs->query, cs->querylen);
+	snap = !full && !same && snap_push(cs) == 0;
+
+	free(cs->query);
+	cs->query = query;
+	cs->querylen = len;
+	if (cs->mode == MATCH_REGEX)
+		regex_query(cs, text);
+	else
+		tokenize(cs);
+
+	if (!same && index_usable(cs, items, longest_token(cs), items->len))
+		full = 1;
+
+	cs->selected = -1;
+	if (full) {
+		cs->length = 0;
+		cs->ranked = 0;
+		cs->nitems = 0;
+	} else if (snap) {
+		s = &cs->snaps[cs->nsnaps - 1];
+		narrow(cs, items, s->completions, s->length, s->ranked,
+		    known);
+	} else if (!same)
+		narrow(cs, items, cs->completions, cs->length, cs->ranked,
+		    known);
+
+	fill(cs, items, want, w);
+	if (first_selected && cs->length > 0)
+		cs->selected = 0;
+}
+
+/*
+ * Select the next or previous selection and update some state. `text'
+ * will be updated with the text of the completion and `textlen' with
+ * the new length. If the memory cannot be allocated `status' will be
+ * set to `ERR'.
+ */
+static void
+complete(struct completions *cs, short first_selected, short p,
+    char **text, int *textlen, enum state *status)
+{
+	const char *t;
+	size_t len;
+	int index;
+
+	if (cs == NULL || cs->length == 0)
+		return;
+
+	/*
+	 * If the first is always selected and the first entry is
+	 * different from the text, expand the text and return
+	 */
+	t = item_text(cs->items, cs->completions[0], &len);
+	if (first_selected &&
+	    cs->selected == 0 &&
+	    (strlen(*text) != len || memcmp(t, *text, len) != 0) &&
+	    !p) {
+		free(*text);
+		*text = strndup(t, len);
+		if (text == NULL) {
+			*status = ERR;
+			return;
+		}
+		*textlen = strlen(*text);
+		return;
+	}
+
+	index = cs->selected;
+
+	if (index == -1 && p)
+		index = 0;
+	index = cs->selected = (cs->length + (p ? index - 1 : index + 1))
+		% cs->length;
+
+	t = item_text(cs->items, cs->completions[cs->selected], &len);
+
+	free(*text);
+	*text = strndup(t, len);
+	if (text == NULL) {
+		fprintf(stderr, "Memory allocation error!\n");
+		*status = ERR;
+		return;
+	}
+	*textlen = strlen(*text);
+}
+
+/* Push the character c at the end of the string pointed by p */
+static int
+pushc(char **p, int maxlen, char c)
+{
+	int len;
+
+	len = strnlen(*p, maxlen);
+	if (!(len < maxlen - 2)) {
+		char *newptr;
+
+		maxlen += maxlen >> 1;
+		newptr = realloc(*p, maxlen);
+		if (newptr == NULL) /* bad */
+			return -1;
+		*p = newptr;
+	}
+
+	(*p)[len] = c;
+	(*p)[len + 1] = '\0';
+	return maxlen;
+}
+
+/*
+ * Remove the last rune from the *UTF-8* string! This is different
+ * from just setting the last byte to 0 (in some cases ofc). Return a
+ * pointer (e) to the last nonzero char. If e < p then p is empty!
+ */
+static char *
+popc(char *p)
+{
+	int len = strlen(p);
+	char *e;
+
+	if (len == 0)
+		return p;
+
+	e = p + len - 1;
+
+	do {
+		char c = *e;
+
+		*e = '\0';
+		e -= 1;
+
+		/*
+		 * If c is a starting byte (11......) or is under
+		 * U+007F we're done.
+		 */
+		if (((c & 0x80) && (c & 0x40)) || !(c & 0x80))
+			break;
+	} while (e >= p);
+
+	return e;
+}
+
+/* Remove the last word plus trailing white spaces from the given string */
+static void
+popw(char *w)
+{
+	short in_word = 1;
+
+	if (*w == '\0')
+		return;
+
+	while (1) {
+		char *e = popc(w);
+
+		if (e < w)
+			return;
+
+		if (in_word && isspace(*e))
+			in_word = 0;
+
+		if (!in_word && !isspace(*e))
+			return;
+	}
+}
+
+/*
+ * If the string is surrounded by quates (`"') remove them and replace
+ * every `\"' in the string with a single double-quote.
+ */
+static char *
+normalize_str(const char *str)
+{
+	int len, p;
+	char *s;
+
+	if ((len = strlen(str)) == 0)
+		return NULL;
+
+	if ((s = calloc(len, sizeof(char))) == NULL)
+		err(1, "calloc");
+	p = 0;
+
+	while (*str) {
+		char c = *str;
+
+		if (*str == '\\') {
+			if (*(str + 1)) {
+				s[p] = *(str + 1);
+				p++;
+				str += 2; /* skip this and the next char */
+				continue;
+			} else
+				break;
+		}
+		if (c == '"') {
+			str++; /* skip only this char */
+			continue;
+		}
+		s[p] = c;
+		p++;
+		str++;
+	}
+
+	return s;
+}
+
+/* Make room for at least n more offsets */
+static void
+scan_grow(struct scan *sc, size_t n)
+{
+	size_t newcap;
+	void *t;
+
+	if (sc->cap - sc->len >= n)
+		return;
+
+	newcap = MAX(sc->cap * 1.5, sc->len + n);
+	if ((t = reallocarray(sc->pos, newcap, sizeof(size_t))) == NULL)
+		err(1, "reallocarray");
+	sc->pos = t;
+	sc->cap = newcap;
+}
+
+#if defined(TARGET_AVX2)
+/* The AVX2 loop of scan(), returns how many bytes were scanned */
+TARGET_AVX2 static size_t
+scan_avx2(struct scan *sc, const char *buf, size_t len, int delim,
+    size_t base)
+{
+	__m256i d = _mm256_set1_epi8(delim);
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		uint32_t m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, d));
+
+		scan_grow(sc, 32);
+		for (; m != 0; m &= m - 1)
+			sc->pos[sc->len++] = base + i + __builtin_ctz(m);
+	}
+
+	return i;
+}
+#endif
+
+/*
+ * Append to `sc' the offsets, plus `base', of every `delim' in the
+ * `len' bytes at `buf'.  With AVX2 or SSE2 32 or 16 bytes are
+ * compared at once and the offsets are extracted from the resulting
+ * bitmask, which is way cheaper than a memchr(3) per line when the
+ * lines are short.  The tail is handled with memchr(3).
+ */
+static void
+scan(struct scan *sc, const char *buf, size_t len, int delim, size_t base)
+{
+	const char *p, *end;
+	size_t i = 0;
+
+#if defined(TARGET_AVX2)
+	if (avx2)
+		i = scan_avx2(sc, buf, len, delim, base);
+#endif
+#if defined(__SSE2__)
+	__m128i d = _mm_set1_epi8(delim);
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		uint32_t m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, d));
+
+		scan_grow(sc, 16);
+		for (; m != 0; m &= m - 1)
+			sc->pos[sc->len++] = base + i + __builtin_ctz(m);
+	}
+#endif
+
+	end = buf + len;
+	for (p = buf + i; (p = memchr(p, delim, end - p)) != NULL; ++p) {
+		scan_grow(sc, 1);
+		sc->pos[sc->len++] = base + (p - buf);
+	}
+}
+
+#if HAVE_PTHREAD
+struct scan_job {
+	pthread_t th;
+	int started;
+	const char *buf;
+	size_t len;
+	size_t base;
+	int delim;
+	struct scan sc;
+};
+
+static void *
+scan_worker(void *arg)
+{
+	struct scan_job *job = arg;
+
+	scan(&job->sc, job->buf, job->len, job->delim, job->base);
+	return NULL;
+}
+#endif
+
+/*
+ * Like scan() but big buffers are split across `nth' threads; the
+ * offsets found by each one are then merged in order.
+ */
+static void
+scan_parallel(struct scan *sc, const char *buf, size_t len, int delim,
+    int nth)
+{
+#if HAVE_PTHREAD
+	struct scan_job *jobs;
+	size_t piece, n;
+	int i;
+
+	nth = MIN(nth, MAX_THREADS);
+	if (len < PARALLEL_SCAN_MIN || nth < 2) {
+		scan(sc, buf, len, delim, 0);
+		return;
+	}
+
+	if ((jobs = calloc(nth, sizeof(*jobs))) == NULL)
+		err(1, "calloc");
+
+	piece = len / nth;
+	for (i = 0; i < nth; ++i) {
+		jobs[i].buf = buf + i * piece;
+		jobs[i].base = i * piece;
+		jobs[i].len = i == nth - 1 ? len - i * piece : piece;
+		jobs[i].delim = delim;
+
+		/* the first piece is done by this thread */
+		if (i != 0)
+			jobs[i].started = pthread_create(&jobs[i].th, NULL,
+			    scan_worker, &jobs[i]) == 0;
+	}
+
+	n = 0;
+	for (i = 0; i < nth; ++i) {
+		if (jobs[i].started)
+			pthread_join(jobs[i].th, NULL);
+		else
+			scan_worker(&jobs[i]);
+		n += jobs[i].sc.len;
+	}
+
+	scan_grow(sc, n);
+	for (i = 0; i < nth; ++i) {
+		memcpy(sc->pos + sc->len, jobs[i].sc.pos,
+		    jobs[i].sc.len * sizeof(size_t));
+		sc->len += jobs[i].sc.len;
+		free(jobs[i].sc.pos);
+	}
+	free(jobs);
+#else
+	scan(sc, buf, len, delim, 0);
+#endif
+}
+
+/* FNV-1a, to look up the items in the history */
+static uint64_t
+history_hash(const char *s, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		h ^= (unsigned char)s[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h != 0 ? h : 1;
+}
+
+/*
+ * Return the slot of `hash' in the table `slots', or the free one
+ * where it would go, or NULL if it's not there and the table is
+ * full.
+ */
+static struct history_slot *
+history_find(struct history_slot *slots, size_t nslots, uint64_t hash)
+{
+	size_t i, n;
+
+	for (i = hash & (nslots - 1), n = 0; n < nslots;
+	    i = (i + 1) & (nslots - 1), ++n)
+		if (slots[i].hash == hash || slots[i].hash == 0)
+			return &slots[i];
+	return NULL;
+}
+
+/*
+ * The score of the slot `s' at the time `now': halved for every
+ * HISTORY_HALFLIFE, and for the rest 2^-x is about 1 - x/2.
+ */
+static uint32_t
+history_decay(const struct history_slot *s, uint32_t now)
+{
+	uint64_t f;
+	uint32_t age, k;
+
+	age = now > s->last ? now - s->last : 0;
+	if ((k = age / HISTORY_HALFLIFE) >= 32)
+		return 0;
+	f = s->score >> k;
+	return f - f * (age % HISTORY_HALFLIFE) / (2 * HISTORY_HALFLIFE);
+}
+
+/*
+ * Write the slots of `old' that are still worth something in a new
+ * history file, at most a quarter full, and rename it to `path', so
+ * it's replaced at once.  It's done only when the history is opened:
+ * a new one, or one that got too full.
+ */
+static void
+history_rewrite(struct history *h, const char *path,
+    const struct history_slot *old, size_t nold)
+{
+	struct history_head head;
+	struct history_slot *slots, *s;
+	char tmp[PATH_MAX];
+	size_t i, kept = 0, nslots;
+	int fd;
+
+	for (i = 0; i < nold; ++i)
+		if (old[i].hash != 0 &&
+		    history_decay(&old[i], h->now) >= HISTORY_FORGET)
+			kept++;
+	for (nslots = HISTORY_SLOTS; kept * 4 >= nslots; nslots *= 2)
+		;
+
+	if ((slots = calloc(nslots, sizeof(*slots))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < nold; ++i) {
+		if (old[i].hash == 0 ||
+		    history_decay(&old[i], h->now) < HISTORY_FORGET)
+			continue;
+		s = history_find(slots, nslots, old[i].hash);
+		s->hash = old[i].hash;
+		s->score = history_decay(&old[i], h->now);
+		s->last = h->now;
+	}
+
+	memcpy(head.magic, HISTORY_MAGIC, sizeof(head.magic));
+	head.nslots = nslots;
+	head.nused = kept;
+
+	if ((size_t)snprintf(tmp, sizeof(tmp), "%s.XXXXXXXXXX", path) >=
+	    sizeof(tmp))
+		errx(1, "%s: path too long", path);
+	if ((fd = mkstemp(tmp)) == -1)
+		err(1, "mkstemp %s", tmp);
+	if (write(fd, &head, sizeof(head)) != sizeof(head) ||
+	    write(fd, slots, nslots * sizeof(*slots)) !=
+	    (ssize_t)(nslots * sizeof(*slots)))
+		err(1, "write %s", tmp);
+	if (rename(tmp, path) == -1)
+		err(1, "rename %s", tmp);
+
+	free(slots);
+	close(h->fd);
+	h->fd = fd;
+}
+
+/* Map the history file, return -1 if it's not one */
+static int
+history_map(struct history *h)
+{
+	struct stat sb;
+	void *p;
+
+	if (fstat(h->fd, &sb) == -1)
+		err(1, "fstat");
+	if ((size_t)sb.st_size < sizeof(struct history_head))
+		return -1;
+
+	p = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+	    h->fd, 0);
+	if (p == MAP_FAILED)
+		err(1, "mmap");
+	h->map = p;
+	h->maplen = sb.st_size;
+	h->head = p;
+	h->slots = (struct history_slot *)(h->head + 1);
+
+	if (memcmp(h->head->magic, HISTORY_MAGIC, sizeof(h->head->magic)) ||
+	    h->head->nslots == 0 ||
+	    (h->head->nslots & (h->head->nslots - 1)) != 0 ||
+	    h->maplen != sizeof(struct history_head) +
+	    (size_t)h->head->nslots * sizeof(struct history_slot))
+		return -1;
+	return 0;
+}
+
+/*
+ * Open the history file at `path', creating it if needed, and map
+ * it.  It must be done before pledge(2), as it may be rewritten.
+ */
+static void
+history_open(struct history *h, const char *path)
+{
+	struct stat sb;
+	char *oldmap;
+	size_t oldlen;
+
+	h->now = time(NULL);
+	h->map = NULL;
+	if ((h->fd = open(path, O_RDWR | O_CREAT, 0600)) == -1)
+		err(1, "open %s", path);
+	if (fstat(h->fd, &sb) == -1)
+		err(1, "fstat %s", path);
+
+	if (sb.st_size == 0)
+		history_rewrite(h, path, NULL, 0);
+	else {
+		if (history_map(h) == -1)
+			errx(1, "%s: not a history file", path);
+		if (h->head->nused * 2 < h->head->nslots)
+			return;
+
+		oldmap = h->map;
+		oldlen = h->maplen;
+		history_rewrite(h, path, h->slots, h->head->nslots);
+		munmap(oldmap, oldlen);
+	}
+
+	if (history_map(h) == -1)
+		errx(1, "%s: not a history file", path);
+}
+
+static void
+history_close(struct history *h)
+{
+	munmap(h->map, h->maplen);
+	close(h->fd);
+}
+
+/*
+ * Return the score of the item `s', `len' bytes long, for its picks:
+ * SCORE_PICK for one just made.
+ */
+static int
+history_score(struct history *h, const char *s, size_t len)
+{
+	struct history_slot *slot;
+
+	slot = history_find(h->slots, h->head->nslots, history_hash(s, len));
+	if (slot == NULL || slot->hash == 0)
+		return 0;
+	return MIN(history_decay(slot, h->now), 1 << 24) * SCORE_PICK / 256;
+}
+
+/*
+ * Record the pick of the item `s', `len' bytes long.  Only its slot,
+ * and then the count of the slots used if it's a new one, are
+ * written, each with a single pwrite(2), so the file is always
+ * valid.  When the table is three quarters full the new items are
+ * not recorded, until it's rewritten the next time it's opened.
+ */
+static void
+history_add(struct history *h, const char *s, size_t len)
+{
+	struct history_slot *slot;
+	uint64_t hash;
+	int new;
+
+	hash = history_hash(s, len);
+	if ((slot = history_find(h->slots, h->head->nslots, hash)) == NULL)
+		return;
+	if ((new = slot->hash == 0)) {
+		if (h->head->nused * 4 >= h->head->nslots * 3)
+			return;
+		h->head->nused++;
+	}
+
+	h->now = time(NULL);
+	slot->score = MIN(history_decay(slot, h->now), UINT32_MAX - 256) +
+	    256;
+	slot->hash = hash;
+	slot->last = h->now;
+
+	if (pwrite(h->fd, slot, sizeof(*slot), (char *)slot - h->map) !=
+	    sizeof(*slot))
+		warn("pwrite");
+	else if (new && pwrite(h->fd, &h->head->nused, sizeof(uint32_t),
+	    offsetof(struct history_head, nused)) != sizeof(uint32_t))
+		warn("pwrite");
+}
+
+/* Make room for at least n more items */
+static void
+items_grow(struct items *items, size_t n)
+{
+	size_t newcap;
+	void *p;
+
+	if (items->cap - items->len >= n)
+		return;
+
+	newcap = MAX(items->cap * 1.5, MAX(items->len + n, 32));
+	p = reallocarray(items->lines, newcap, sizeof(char *));
+	if (p == NULL)
+		err(1, "reallocarray");
+	items->lines = p;
+
+	p = reallocarray(items->lens, newcap, sizeof(uint32_t));
+	if (p == NULL)
+		err(1, "reallocarray");
+	items->lens = p;
+
+	p = reallocarray(items->folded, newcap, sizeof(char *));
+	if (p == NULL)
+		err(1, "reallocarray");
+	items->folded = p;
+
+	if (items->sep != NULL) {
+		p = reallocarray(items->vlines, newcap, sizeof(char *));
+		if (p == NULL)
+			err(1, "reallocarray");
+		items->vlines = p;
+	}
+
+	if (items->hist != NULL) {
+		p = reallocarray(items->frec, newcap, sizeof(int));
+		if (p == NULL)
+			err(1, "reallocarray");
+		items->frec = p;
+	}
+
+	items->cap = newcap;
+}
+
+/*
+ * Store the folded copy of the `len' bytes at `s' in the fold arena,
+ * always leaving FOLD_PAD bytes free after it.
+ */
+static char *
+fold_push(struct items *items, const char *s, size_t len)
+{
+	struct chunk *c;
+	char *d;
+
+	c = items->fchunks;
+	if (c == NULL || c->cap - c->len < len + FOLD_PAD) {
+		size_t cap;
+
+		cap = MAX(ARENA_CHUNK_SIZE, len + FOLD_PAD);
+		if ((c = malloc(sizeof(*c) + cap)) == NULL)
+			err(1, "malloc");
+		c->cap = cap;
+		c->len = 0;
+		c->next = items->fchunks;
+		items->fchunks = c;
+	}
+
+	d = c->data + c->len;
+	fold(d, s, len);
+	c->len += len;
+	return d;
+}
+
+/*
+ * Add the line to the items.  The line must stay valid as long as the
+ * items are used.
+ */
+static void
+items_push(struct items *items, char *line, size_t len)
+{
+	char *t;
+
+	if (len > UINT32_MAX)
+		errx(1, "line too long");
+	if (items->len == UINT32_MAX)
+		errx(1, "too many items");
+
+	items_grow(items, 1);
+
+	items->lines[items->len] = line;
+	items->lens[items->len] = len;
+	if (items->hist != NULL)
+		items->frec[items->len] = history_score(items->hist, line,
+		    len);
+	if (items->sep != NULL) {
+		if ((t = memmem(line, len, items->sep, items->seplen)) == NULL)
+			t = line;
+		else
+			t += items->seplen;
+		items->vlines[items->len] = t;
+		len -= t - line;
+		line = t;
+	}
+	items->folded[items->len] = fold_push(items, line, len);
+	items->len++;
+}
+
+/*
+ * Start a new chunk in the arena, moving there the incomplete line
+ * of the current one.
+ */
+static struct chunk *
+chunk_new(struct items *items)
+{
+	struct chunk *c, *old;
+	size_t partlen = 0, cap;
+
+	if ((old = items->chunks) != NULL)
+		partlen = old->len - items->partial;
+
+	cap = MAX(ARENA_CHUNK_SIZE, partlen + READ_BUF_SIZE + 1);
+	if ((c = malloc(sizeof(*c) + cap)) == NULL)
+		err(1, "malloc");
+
+	c->cap = cap;
+	c->len = partlen;
+	if (partlen != 0) {
+		memcpy(c->data, old->data + items->partial, partlen);
+		old->len = items->partial;
+	}
+
+	c->next = old;
+	items->chunks = c;
+	items->partial = 0;
+	return c;
+}
+
+/* Free the items and the arena */
+static void
+items_free(struct items *items)
+{
+	struct chunk *c, *next;
+
+	for (c = items->chunks; c != NULL; c = next) {
+		next = c->next;
+		free(c);
+	}
+	for (c = items->fchunks; c != NULL; c = next) {
+		next = c->next;
+		free(c);
+	}
+
+	if (items->map != NULL)
+		munmap(items->map, items->maplen);
+
+	free(items->lines);
+	free(items->vlines);
+	free(items->lens);
+	free(items->folded);
+	free(items->masks);
+	free(items->frec);
+	index_free(items->tri);
+	free(items->sorted);
+	free(items->sc.pos);
 }
 
-/* Push the character c at the end of the string pointed by p */
+/*
+ * If fd is a regular file, map it in memory and index the lines in
+ * place, without copying them.  Return -1 if it cannot be mapped: in
+ * that case the items have to be read with readlines().
+ */
 static int
-pushc(char **p, int maxlen, char c)
+mapfile(struct items *items, int fd)
 {
-	int len;
+	struct scan sc;
+	struct stat sb;
+	off_t off;
+	size_t len, start, i;
+	char *p;
 
-	len = strnlen(*p, maxlen);
-	if (!(len < maxlen - 2)) {
-		char *newptr;
+	if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode))
+		return -1;
 
-		maxlen += maxlen >> 1;
-		newptr = realloc(*p, maxlen);
-		if (newptr == NULL) /* bad */
-			return -1;
-		*p = newptr;
+	/* honour what was already read from it */
+	if ((off = lseek(fd, 0, SEEK_CUR)) == -1)
+		off = 0;
+
+	if (sb.st_size == 0 || off >= sb.st_size) {
+		items->fd = -1;
+		return 0;
 	}
 
-	(*p)[len] = c;
-	(*p)[len + 1] = '\0';
-	return maxlen;
+	p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		return -1;
+
+	items->map = p;
+	items->maplen = sb.st_size;
+
+	p += off;
+	len = sb.st_size - off;
+
+	memset(&sc, 0, sizeof(sc));
+	scan_parallel(&sc, p, len, items->delim, ncpus());
+	items_grow(items, sc.len + 1);
+
+	start = 0;
+	for (i = 0; i < sc.len; ++i) {
+		items_push(items, p + start, sc.pos[i] - start);
+		start = sc.pos[i] + 1;
+	}
+	if (start < len)
+		items_push(items, p + start, len - start);
+
+	free(sc.pos);
+	items->fd = -1;
+	return 0;
 }
 
 /*
- * Remove the last rune from the *UTF-8* string! This is different
- * from just setting the last byte to 0 (in some cases ofc). Return a
- * pointer (e) to the last nonzero char. If e < p then p is empty!
+ * Read what's available on items->fd and add every complete line to
+ * the items.  The data is read straight into the arena and the lines
+ * are split in place.  Only one read(2) is done, so it doesn't block
+ * if called after poll(2) said the fd is readable.  On EOF the
+ * eventual last line is added and items->fd is set to -1.  Return
+ * the number of items added.
  */
-static char *
-popc(char *p)
+static size_t
+readlines(struct items *items)
 {
-	int len = strlen(p);
-	char *e;
+	struct chunk *c;
+	size_t len, i;
+	ssize_t r;
+	char *p, *nl;
 
-	if (len == 0)
-		return p;
+	len = items->len;
 
-	e = p + len - 1;
+	/* always keep a byte for the NUL of the last line */
+	c = items->chunks;
+	if (c == NULL || c->cap - c->len < READ_BUF_SIZE + 1)
+		c = chunk_new(items);
 
-	do {
-		char c = *e;
+	r = read(items->fd, c->data + c->len, c->cap - c->len - 1);
+	if (r == -1) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		err(1, "read");
+	}
 
-		*e = '\0';
-		e -= 1;
+	if (r == 0) {
+		items->fd = -1;
+		if (c->len != items->partial) {
+			c->data[c->len] = '\0';
+			items_push(items, c->data + items->partial,
+			    c->len - items->partial);
+			items->partial = c->len + 1;
+			c->len++;
+		}
+		return items->len - len;
+	}
 
-		/*
-		 * If c is a starting byte (11......) or is under
-		 * U+007F we're done.
-		 */
-		if (((c & 0x80) && (c & 0x40)) || !(c & 0x80))
-			break;
-	} while (e >= p);
+	/* the incomplete line was already scanned */
+	items->sc.len = 0;
+	scan(&items->sc, c->data + c->len, r, items->delim, c->len);
+	items_grow(items, items->sc.len);
+
+	p = c->data + items->partial;
+	for (i = 0; i < items->sc.len; ++i) {
+		nl = c->data + items->sc.pos[i];
+		*nl = '\0';
+		items_push(items, p, nl - p);
+		p = nl + 1;
+	}
 
-	return e;
+	c->len += r;
+	items->partial = p - c->data;
+	return items->len - len;
 }
 
-/* Remove the last word plus trailing white spaces from the given string */
+/* Load in `g' the metrics of the codepoint `cp' */
 static void
-popw(char *w)
+glyph_load(struct rendering *r, uint32_t cp, struct glyph *g)
 {
-	short in_word = 1;
-
-	if (*w == '\0')
-		return;
-
-	while (1) {
-		char *e = popc(w);
+	XGlyphInfo gi;
+	FT_UInt id;
 
-		if (e < w)
-			return;
+	id = XftCharIndex(r->d, r->font, cp);
+	XftGlyphExtents(r->d, r->font, &id, 1, &gi);
+	g->cp = cp;
+	g->adv = gi.xOff;
+	g->right = gi.width - gi.x;
+}
 
-		if (in_word && isspace(*e))
-			in_word = 0;
+/* Forget the metrics of the codepoints, and load the first 256 */
+static void
+glyphs_reset(struct rendering *r)
+{
+	uint32_t cp;
 
-		if (!in_word && !isspace(*e))
-			return;
-	}
+	for (cp = 0; cp < 256; ++cp)
+		glyph_load(r, cp, &r->latin1[cp]);
+	if (r->glyphs != NULL)
+		memset(r->glyphs, 0, r->glyphscap * sizeof(*r->glyphs));
+	r->nglyphs = 0;
 }
 
-/*
- * If the string is surrounded by quates (`"') remove them and replace
- * every `\"' in the string with a single double-quote.
- */
-static char *
-normalize_str(const char *str)
+/* Double the hash table of the codepoints past 255 */
+static void
+glyphs_grow(struct rendering *r)
 {
-	int len, p;
-	char *s;
-
-	if ((len = strlen(str)) == 0)
-		return NULL;
+	struct glyph *old = r->glyphs;
+	size_t i, j, oldcap = r->glyphscap;
 
-	if ((s = calloc(len, sizeof(char))) == NULL)
+	r->glyphscap = MAX(oldcap * 2, 256);
+	if ((r->glyphs = calloc(r->glyphscap, sizeof(*r->glyphs))) == NULL)
 		err(1, "calloc");
-	p = 0;
 
-	while (*str) {
-		char c = *str;
-
-		if (*str == '\\') {
-			if (*(str + 1)) {
-				s[p] = *(str + 1);
-				p++;
-				str += 2; /* skip this and the next char */
-				continue;
-			} else
-				break;
-		}
-		if (c == '"') {
-			str++; /* skip only this char */
+	for (i = 0; i < oldcap; ++i) {
+		if (old[i].cp == 0)
 			continue;
-		}
-		s[p] = c;
-		p++;
-		str++;
+		j = (old[i].cp * 0x9e3779b1U) & (r->glyphscap - 1);
+		while (r->glyphs[j].cp != 0)
+			j = (j + 1) & (r->glyphscap - 1);
+		r->glyphs[j] = old[i];
 	}
-
-	return s;
+	free(old);
 }
 
-static char **
-readlines(size_t *lineslen)
+/* Return the metrics of `cp', loading them the first time */
+static const struct glyph *
+glyph_get(struct rendering *r, uint32_t cp)
 {
-	size_t len = 0, cap = 0;
-	size_t linesize = 0;
-	ssize_t linelen;
-	char *line = NULL, **lines = NULL;
+	size_t i;
 
-	while ((linelen = getline(&line, &linesize, stdin)) != -1) {
-		if (linelen != 0 && line[linelen-1] == '\n')
-			line[linelen-1] = '\0';
+	if (cp < 256)
+		return &r->latin1[cp];
 
-		if (len == cap) {
-			size_t newcap;
-			void *t;
+	if (r->nglyphs * 2 >= r->glyphscap)
+		glyphs_grow(r);
 
-			newcap = MAX(cap * 1.5, 32);
-			t = recallocarray(lines, cap, newcap, sizeof(char *));
-			if (t == NULL)
-				err(1, "recallocarray");
-			cap = newcap;
-			lines = t;
-		}
+	/* 0 is a free slot, as it's never in the table */
+	i = (cp * 0x9e3779b1U) & (r->glyphscap - 1);
+	for (; r->glyphs[i].cp != 0; i = (i + 1) & (r->glyphscap - 1))
+		if (r->glyphs[i].cp == cp)
+			return &r->glyphs[i];
 
-		if ((lines[len++] = strdup(line)) == NULL)
-			err(1, "strdup");
+	glyph_load(r, cp, &r->glyphs[i]);
+	r->nglyphs++;
+	return &r->glyphs[i];
+}
+
+/*
+ * Return where the ink of `str' ends, and store in `*adv' how far
+ * the pen moves if not NULL.  It's the sum of the metrics of the
+ * glyphs, what XftTextExtentsUtf8() would give, as it doesn't kern.
+ * The text that isn't valid UTF-8 is still measured by it, as it
+ * deals with the invalid sequences its own way.
+ */
+static int
+text_width(struct rendering *r, const char *str, int len, int *adv)
+{
+	const unsigned char *s = (const unsigned char *)str;
+	const struct glyph *g;
+	XGlyphInfo gi;
+	uint32_t cp;
+	size_t n;
+	int i, x = 0, right = 0;
+
+	for (i = 0; i < len; i += n) {
+		if (s[i] < 0x80) {
+			g = &r->latin1[s[i]];
+			n = 1;
+		} else if ((n = utf8_decode(s + i, len - i, &cp)) != 0)
+			g = glyph_get(r, cp);
+		else
+			goto fallback;
+
+		if (i == 0 || x + g->right > right)
+			right = x + g->right;
+		x += g->adv;
 	}
 
-	if (ferror(stdin))
-		err(1, "getline");
-	free(line);
+	if (adv != NULL)
+		*adv = x;
+	return right;
 
-	*lineslen = len;
-	return lines;
+fallback:
+	XftTextExtentsUtf8(r->d, r->font, s, len, &gi);
+	if (adv != NULL)
+		*adv = gi.xOff;
+	return gi.width - gi.x;
 }
 
 /*
@@ -452,10 +3739,9 @@ text_extents(char *str, int len, struct rendering *r, int *ret_width,
     int *ret_height)
 {
 	int height, width;
-	XGlyphInfo gi;
-	XftTextExtentsUtf8(r->d, r->font, str, len, &gi);
+
 	height = r->font->ascent - r->font->descent;
-	width = gi.width - gi.x;
+	width = text_width(r, str, len, NULL);
 
 	if (ret_width != NULL)
 		*ret_width = width;
@@ -464,6 +3750,22 @@ text_extents(char *str, int len, struct rendering *r, int *ret_width,
 	return width;
 }
 
+/*
+ * Return the width of `text', the index-th item.  Only the first
+ * time it's drawn, or after a collision in the cache, is it measured.
+ */
+static int
+item_width(struct rendering *r, uint32_t index, char *text, int len)
+{
+	struct width *w = &r->widths[index % WIDTHS_CACHE];
+
+	if (w->index != index) {
+		w->index = index;
+		w->width = text_extents(text, len, r, NULL, NULL);
+	}
+	return w->width;
+}
+
 static void
 draw_string(char *str, int len, int x, int y, struct rendering *r,
     enum obj_type tt)
@@ -479,6 +3781,36 @@ draw_string(char *str, int len, int x, int y, struct rendering *r,
 	XftDrawStringUtf8(r->xftdraw, &xftcolor, r->font, x, y, str, len);
 }
 
+/*
+ * Like draw_string(), but the `n' marks `m' of the text are drawn
+ * with the match color.
+ */
+static void
+draw_marked(char *str, int len, int x, int y, struct rendering *r,
+    enum obj_type tt, const struct mark *m, size_t n)
+{
+	size_t i;
+	int pos = 0, end, adv;
+
+	for (i = 0; i < n && (int)m[i].start < len; ++i) {
+		if ((int)m[i].start > pos) {
+			draw_string(str + pos, m[i].start - pos, x, y, r, tt);
+			text_width(r, str + pos, m[i].start - pos, &adv);
+			x += adv;
+		}
+
+		end = MIN((int)m[i].end, len);
+		XftDrawStringUtf8(r->xftdraw, &r->xft_colors[3], r->font, x, y,
+		    str + m[i].start, end - m[i].start);
+		text_width(r, str + m[i].start, end - m[i].start, &adv);
+		x += adv;
+		pos = end;
+	}
+
+	if (pos < len)
+		draw_string(str + pos, len - pos, x, y, r, tt);
+}
+
 /* Duplicate the string and substitute every space with a 'n` */
 static char *
 strdupn(char *str)
@@ -499,34 +3831,54 @@ strdupn(char *str)
 	return dup;
 }
 
-static int
-draw_v_box(struct rendering *r, int y, char *prefix, int prefix_width,
-    enum obj_type t, char *text)
+/* The colors, the padding and the borders of the boxes of type `t' */
+static void
+box_style(struct rendering *r, enum obj_type t, GC **border_color,
+    int **padding, int **borders, GC *bg)
 {
-	GC *border_color, bg;
-	int *padding, *borders;
-	int ret = 0, inner_width, inner_height, x;
-
 	switch (t) {
 	case PROMPT:
-		border_color = r->p_borders_bg;
-		padding = r->p_padding;
-		borders = r->p_borders;
-		bg = r->bgs[0];
+		*border_color = r->p_borders_bg;
+		*padding = r->p_padding;
+		*borders = r->p_borders;
+		*bg = r->bgs[0];
 		break;
 	case COMPL:
-		border_color = r->c_borders_bg;
-		padding = r->c_padding;
-		borders = r->c_borders;
-		bg = r->bgs[1];
+		*border_color = r->c_borders_bg;
+		*padding = r->c_padding;
+		*borders = r->c_borders;
+		*bg = r->bgs[1];
 		break;
 	case COMPL_HIGH:
-		border_color = r->ch_borders_bg;
-		padding = r->ch_padding;
-		borders = r->ch_borders;
-		bg = r->bgs[2];
+		*border_color = r->ch_borders_bg;
+		*padding = r->ch_padding;
+		*borders = r->ch_borders;
+		*bg = r->bgs[2];
 		break;
 	}
+}
+
+/* The height of the boxes of type `t' in the vertical layout */
+static int
+v_box_height(struct rendering *r, enum obj_type t)
+{
+	GC *border_color, bg;
+	int *padding, *borders;
+
+	box_style(r, t, &border_color, &padding, &borders, &bg);
+	return borders[0] + padding[0] + r->text_height + padding[2] +
+	    borders[2];
+}
+
+static int
+draw_v_box(struct rendering *r, int y, char *prefix, int prefix_width,
+    enum obj_type t, char *text, int len, const struct mark *m, size_t nm)
+{
+	GC *border_color, bg;
+	int *padding, *borders;
+	int ret = 0, inner_width, inner_height, x;
+
+	box_style(r, t, &border_color, &padding, &borders, &bg);
 
 	ret = borders[0] + padding[0] + r->text_height + padding[2] + borders[2];
 
@@ -534,26 +3886,26 @@ draw_v_box(struct rendering *r, int y, char *prefix, int prefix_width,
 	inner_height = padding[0] + r->text_height + padding[2];
 
 	/* Border top */
-	XFillRectangle(r->d, r->w, border_color[0], r->x_zero, y, r->width,
+	XFillRectangle(r->d, r->buf, border_color[0], r->x_zero, y, r->width,
 	    borders[0]);
 
 	/* Border right */
-	XFillRectangle(r->d, r->w, border_color[1],
+	XFillRectangle(r->d, r->buf, border_color[1],
 	    r->x_zero + INNER_WIDTH(r) - borders[1], y, borders[1], ret);
 
 	/* Border bottom */
-	XFillRectangle(r->d, r->w, border_color[2], r->x_zero,
+	XFillRectangle(r->d, r->buf, border_color[2], r->x_zero,
 	    y + borders[0] + padding[0] + r->text_height + padding[2],
 	    r->width, borders[2]);
 
 	/* Border left */
-	XFillRectangle(r->d, r->w, border_color[3], r->x_zero, y, borders[3],
+	XFillRectangle(r->d, r->buf, border_color[3], r->x_zero, y, borders[3],
 	    ret);
 
 	/* bg */
 	x = r->x_zero + borders[3];
 	y += borders[0];
-	XFillRectangle(r->d, r->w, bg, x, y, inner_width, inner_height);
+	XFillRectangle(r->d, r->buf, bg, x, y, inner_width, inner_height);
 
 	/* content */
 	y += padding[0] + r->text_height;
@@ -562,39 +3914,25 @@ draw_v_box(struct rendering *r, int y, char *prefix, int prefix_width,
 		draw_string(prefix, strlen(prefix), x, y, r, t);
 		x += prefix_width;
 	}
-	draw_string(text, strlen(text), x, y, r, t);
+	draw_marked(text, len, x, y, r, t, m, nm);
 
 	return ret;
 }
 
+/*
+ * Draw a box for the horizontal layout at `x' and return its width.
+ * `tw' is the width of the text, or -1 to measure it.
+ */
 static int
 draw_h_box(struct rendering *r, int x, char *prefix, int prefix_width,
-    enum obj_type t, char *text)
+    enum obj_type t, char *text, int len, int tw,
+    const struct mark *m, size_t nm)
 {
 	GC *border_color, bg;
 	int *padding, *borders;
-	int ret = 0, inner_width, inner_height, y, text_width;
+	int ret = 0, inner_width, inner_height, y;
 
-	switch (t) {
-	case PROMPT:
-		border_color = r->p_borders_bg;
-		padding = r->p_padding;
-		borders = r->p_borders;
-		bg = r->bgs[0];
-		break;
-	case COMPL:
-		border_color = r->c_borders_bg;
-		padding = r->c_padding;
-		borders = r->c_borders;
-		bg = r->bgs[1];
-		break;
-	case COMPL_HIGH:
-		border_color = r->ch_borders_bg;
-		padding = r->ch_padding;
-		borders = r->ch_borders;
-		bg = r->bgs[2];
-		break;
-	}
+	box_style(r, t, &border_color, &padding, &borders, &bg);
 
 	if (padding[0] < 0 || padding[2] < 0) {
 		padding[0] = INNER_HEIGHT(r) - borders[0] - borders[2]
@@ -609,37 +3947,38 @@ draw_h_box(struct rendering *r, int x, char *prefix, int prefix_width,
 		padding[0] = padding[2] = 0;
 
 	/* Get the text width */
-	text_extents(text, strlen(text), r, &text_width, NULL);
+	if (tw < 0)
+		text_extents(text, len, r, &tw, NULL);
 	if (prefix != NULL)
-		text_width += prefix_width;
+		tw += prefix_width;
 
-	ret = borders[3] + padding[3] + text_width + padding[1] + borders[1];
+	ret = borders[3] + padding[3] + tw + padding[1] + borders[1];
 
-	inner_width = padding[3] + text_width + padding[1];
+	inner_width = padding[3] + tw + padding[1];
 	inner_height = INNER_HEIGHT(r) - borders[0] - borders[2];
 
 	/* Border top */
-	XFillRectangle(r->d, r->w, border_color[0], x, r->y_zero, ret,
+	XFillRectangle(r->d, r->buf, border_color[0], x, r->y_zero, ret,
 	    borders[0]);
 
 	/* Border right */
-	XFillRectangle(r->d, r->w, border_color[1],
+	XFillRectangle(r->d, r->buf, border_color[1],
 	    x + borders[3] + inner_width, r->y_zero, borders[1],
 	    INNER_HEIGHT(r));
 
 	/* Border bottom */
-	XFillRectangle(r->d, r->w, border_color[2], x,
+	XFillRectangle(r->d, r->buf, border_color[2], x,
 	    r->y_zero + INNER_HEIGHT(r) - borders[2], ret,
 	    borders[2]);
 
 	/* Border left */
-	XFillRectangle(r->d, r->w, border_color[3], x, r->y_zero, borders[3],
+	XFillRectangle(r->d, r->buf, border_color[3], x, r->y_zero, borders[3],
 	    INNER_HEIGHT(r));
 
 	/* bg */
 	x += borders[3];
 	y = r->y_zero + borders[0];
-	XFillRectangle(r->d, r->w, bg, x, y, inner_width, inner_height);
+	XFillRectangle(r->d, r->buf, bg, x, y, inner_width, inner_height);
 
 	/* content */
 	y += padding[0] + r->text_height;
@@ -648,117 +3987,365 @@ draw_h_box(struct rendering *r, int x, char *prefix, int prefix_width,
 		draw_string(prefix, strlen(prefix), x, y, r, t);
 		x += prefix_width;
 	}
-	draw_string(text, strlen(text), x, y, r, t);
+	draw_marked(text, len, x, y, r, t, m, nm);
 
 	return ret;
 }
 
+/* Remember that the next completion drawn is at `offset' */
+static void
+offset_add(struct completions *cs, ssize_t offset)
+{
+	if (cs->noffsets == cs->offsetscap) {
+		size_t newcap;
+		void *t;
+
+		newcap = MAX(cs->offsetscap * 2, 32);
+		t = reallocarray(cs->offsets, newcap, sizeof(ssize_t));
+		if (t == NULL)
+			err(1, "reallocarray");
+		cs->offsets = t;
+		cs->offsetscap = newcap;
+	}
+
+	cs->offsets[cs->noffsets++] = offset;
+}
+
 /*
  * ,-----------------------------------------------------------------,
  * | 20 char text     | completion | completion | completion | compl |
  *  `-----------------------------------------------------------------'
  */
 static void
-draw_horizontally(struct rendering *r, char *text, struct completions *cs)
+draw_horizontally(struct rendering *r, char *text, struct completions *cs,
+    int maxx)
 {
-	size_t i;
+	const struct mark *m;
+	size_t i, nm, len;
+	char *l;
 	int x = r->x_zero;
 
+	/* Draw the background */
+	XFillRectangle(r->d, r->buf, r->bgs[1], r->x_zero, r->y_zero,
+	    INNER_WIDTH(r), INNER_HEIGHT(r));
+	r->drawn = NULL;
+
 	/* Draw the prompt */
-	x += draw_h_box(r, x, r->ps1, r->ps1w, PROMPT, text);
+	x += draw_h_box(r, x, r->ps1, r->ps1w, PROMPT, text, strlen(text),
+	    -1, NULL, 0);
 
+	cs->noffsets = 0;
 	for (i = r->offset; i < cs->length; ++i) {
 		enum obj_type t;
 
-		if (cs->selected == (ssize_t)i)
-			t = COMPL_HIGH;
-		else
-			t = COMPL;
+		if (cs->selected == (ssize_t)i)
+			t = COMPL_HIGH;
+		else
+			t = COMPL;
+
+		offset_add(cs, x);
+
+		l = item_text(cs->items, cs->completions[i], &len);
+		m = marks_get(cs, cs->completions[i], &nm);
+		x += draw_h_box(r, x, NULL, 0, t, l, len,
+		    item_width(r, cs->completions[i], l, len), m, nm);
+
+		if (x > maxx)
+			break;
+	}
+}
+
+/* Add a box to the next frame, see draw_vertically() */
+static void
+box_add(struct rendering *r, uint32_t index, short high, int pos, int size)
+{
+	struct box *b;
+
+	if (r->nnext == r->boxescap) {
+		size_t newcap;
+		void *t;
+
+		/* the two lists are swapped, so they grow together */
+		newcap = MAX(r->boxescap * 2, 32);
+		t = reallocarray(r->next, newcap, sizeof(struct box));
+		if (t == NULL)
+			err(1, "reallocarray");
+		r->next = t;
+		t = reallocarray(r->boxes, newcap, sizeof(struct box));
+		if (t == NULL)
+			err(1, "reallocarray");
+		r->boxes = t;
+		r->boxescap = newcap;
+	}
+
+	b = &r->next[r->nnext++];
+	b->index = index;
+	b->high = high;
+	b->keep = 0;
+	b->pos = pos;
+	b->size = size;
+	b->moved = 0;
+}
+
+/*
+ * Can't the text of the boxes of type `t' spill out of them, over
+ * the ones above or below?
+ */
+static int
+v_box_sealed(struct rendering *r, enum obj_type t)
+{
+	GC *border_color, bg;
+	int *padding, *borders;
+
+	box_style(r, t, &border_color, &padding, &borders, &bg);
+	return borders[0] + padding[0] >= r->font->descent &&
+	    padding[2] + borders[2] >= r->font->descent;
+}
+
+/*
+ * Find the boxes of the next frame that are already in the back
+ * buffer: the same item, drawn the same way, in the last frame.  The
+ * ones that moved as much as most of them did, e.g. when the list
+ * is scrolled, are copied to their new place at once, and `keep' is
+ * set for them.  Return 0 if the whole frame must be drawn instead,
+ * e.g. when the completions or their marks changed.
+ */
+static int
+damage(struct rendering *r, const struct completions *cs)
+{
+	struct box *nb = r->next, *ob = r->boxes;
+	size_t i, j, count, best = 0;
+	int d = 0, lo = 0, hi = 0, bottom;
+
+	if (r->drawn != cs || r->drawngen != cs->marksgen ||
+	    !v_box_sealed(r, COMPL) || !v_box_sealed(r, COMPL_HIGH))
+		return 0;
+
+	/* the ones cut by the border aren't whole */
+	bottom = r->y_zero + INNER_HEIGHT(r);
+	for (i = 0; i < r->nnext; ++i) {
+		for (j = 0; j < r->nboxes; ++j)
+			if (ob[j].index == nb[i].index)
+				break;
+		if (j == r->nboxes || ob[j].high != nb[i].high ||
+		    ob[j].pos + ob[j].size > bottom)
+			continue;
+		nb[i].keep = 1;
+		nb[i].moved = nb[i].pos - ob[j].pos;
+	}
+
+	for (i = 0; i < r->nnext; ++i) {
+		if (!nb[i].keep)
+			continue;
+		for (j = i, count = 0; j < r->nnext; ++j)
+			if (nb[j].keep && nb[j].moved == nb[i].moved)
+				count++;
+		if (count > best) {
+			best = count;
+			d = nb[i].moved;
+		}
+	}
+
+	/* the others are drawn again */
+	for (i = 0, count = 0; i < r->nnext; ++i) {
+		if (!nb[i].keep || nb[i].moved != d) {
+			nb[i].keep = 0;
+			continue;
+		}
+		if (count++ == 0 || nb[i].pos - d < lo)
+			lo = nb[i].pos - d;
+		if (count == 1 || nb[i].pos - d + nb[i].size > hi)
+			hi = nb[i].pos - d + nb[i].size;
+	}
+
+	if (count > 0 && d != 0)
+		XCopyArea(r->d, r->buf, r->buf, r->copygc, 0, lo, r->width,
+		    hi - lo, 0, lo + d);
+	return 1;
+}
+
+/*
+ * ,-----------------------------------------------------------------,
+ * |  prompt                                                         |
+ * |-----------------------------------------------------------------|
+ * |  completion                                                     |
+ * |-----------------------------------------------------------------|
+ * |  completion                                                     |
+ * `-----------------------------------------------------------------'
+ *
+ * Only the boxes that aren't already in the back buffer are drawn,
+ * see damage(), so moving the selection or scrolling the list draws
+ * a few boxes instead of all of them.
+ */
+static void
+draw_vertically(struct rendering *r, char *text, struct completions *cs)
+{
+	const struct mark *m;
+	struct box *b, *t;
+	size_t i, nm, len;
+	char *l;
+	int y = r->y_zero, bottom = r->y_zero + INNER_HEIGHT(r), h;
+
+	/* where the boxes go */
+	r->nnext = 0;
+	cs->noffsets = 0;
+	y += v_box_height(r, PROMPT);
+	for (i = r->offset; i < cs->length; ++i) {
+		h = v_box_height(r, cs->selected == (ssize_t)i ? COMPL_HIGH :
+		    COMPL);
+		offset_add(cs, y);
+		box_add(r, cs->completions[i], cs->selected == (ssize_t)i, y,
+		    h);
+		y += h;
+
+		if (y > INNER_HEIGHT(r))
+			break;
+	}
+
+	/* Draw the background, only below the boxes if they're reused */
+	if (!damage(r, cs))
+		XFillRectangle(r->d, r->buf, r->bgs[1], r->x_zero, r->y_zero,
+		    INNER_WIDTH(r), INNER_HEIGHT(r));
+	else if (y < bottom)
+		XFillRectangle(r->d, r->buf, r->bgs[1], r->x_zero, y,
+		    INNER_WIDTH(r), bottom - y);
 
-		cs->completions[i].offset = x;
+	draw_v_box(r, r->y_zero, r->ps1, r->ps1w, PROMPT, text, strlen(text),
+	    NULL, 0);
 
-		x += draw_h_box(r, x, NULL, 0, t,
-		    cs->completions[i].completion);
+	for (i = 0; i < r->nnext; ++i) {
+		b = &r->next[i];
+		if (b->keep)
+			continue;
 
-		if (x > INNER_WIDTH(r))
-			break;
+		l = item_text(cs->items, b->index, &len);
+		m = marks_get(cs, b->index, &nm);
+		draw_v_box(r, b->pos, NULL, 0, b->high ? COMPL_HIGH : COMPL,
+		    l, len, m, nm);
 	}
 
-	for (i += 1; i < cs->length; ++i)
-		cs->completions[i].offset = -1;
+	t = r->boxes;
+	r->boxes = r->next;
+	r->next = t;
+	r->nboxes = r->nnext;
+	r->drawn = cs;
+	r->drawngen = cs->marksgen;
 }
 
 /*
- * ,-----------------------------------------------------------------,
- * |  prompt                                                         |
- * |-----------------------------------------------------------------|
- * |  completion                                                     |
- * |-----------------------------------------------------------------|
- * |  completion                                                     |
- * `-----------------------------------------------------------------'
+ * Write in `str' the status: how many items were read while still
+ * loading them, then how many matches there are out of all the
+ * items.  The ellipsis means that not all the items were filtered
+ * yet, so the count may still grow.
  */
-static void
-draw_vertically(struct rendering *r, char *text, struct completions *cs)
+static int
+status_text(struct rendering *r, struct completions *cs, char *str,
+    size_t size)
 {
-	size_t i;
-	int y = r->y_zero;
+	int len;
 
-	y += draw_v_box(r, y, r->ps1, r->ps1w, PROMPT, text);
+	if (r->loading)
+		len = snprintf(str, size, "loading %zu items\u2026",
+		    r->nitems);
+	else if (r->filtering)
+		len = snprintf(str, size, "filtering %zu items\u2026",
+		    r->nitems);
+	else
+		len = snprintf(str, size, "%zu/%zu%s", cs->length, r->nitems,
+		    cs->nitems < r->nitems ? "\u2026" : "");
 
-	for (i = r->offset; i < cs->length; ++i) {
-		enum obj_type t;
+	if (len < 0 || (size_t)len >= size)
+		return 0;
+	return len;
+}
 
-		if (cs->selected == (ssize_t)i)
-			t = COMPL_HIGH;
-		else
-			t = COMPL;
+/*
+ * Draw the status, `width' pixels wide.  It's rendered on the right
+ * side of the prompt line, over everything else.
+ */
+static void
+draw_status(struct rendering *r, char *str, int len, int width)
+{
+	int x, y;
+
+	x = r->x_zero + INNER_WIDTH(r) - r->p_padding[1] - width;
+	y = r->y_zero + r->p_borders[0];
+	XFillRectangle(r->d, r->buf, r->bgs[0], x - r->p_padding[3], y,
+	    r->p_padding[3] + width, r->p_padding[0] + r->text_height
+	    + r->p_padding[2]);
 
-		cs->completions[i].offset = y;
+	y += r->p_padding[0] + r->text_height;
+	draw_string(str, len, x, y, r, PROMPT);
+}
 
-		y += draw_v_box(r, y, NULL, 0, t,
-		    cs->completions[i].completion);
+/*
+ * Make the back buffer as big as the window again, if it was
+ * resized, and move the Xft drawable on the new one.
+ */
+static void
+buf_resize(struct rendering *r)
+{
+	if (r->bufwidth == r->width && r->bufheight == r->height)
+		return;
 
-		if (y > INNER_HEIGHT(r))
-			break;
-	}
+	XFreePixmap(r->d, r->buf);
+	r->buf = XCreatePixmap(r->d, r->w, r->width, r->height, r->depth);
+	r->bufwidth = r->width;
+	r->bufheight = r->height;
+	XftDrawChange(r->xftdraw, r->buf);
+	r->drawn = NULL;
+}
 
-	for (i += 1; i < cs->length; ++i)
-		cs->completions[i].offset = -1;
+/* Copy the back buffer, the last frame drawn, on the window */
+static void
+present(struct rendering *r)
+{
+	XCopyArea(r->d, r->buf, r->w, r->copygc, 0, 0, r->bufwidth,
+	    r->bufheight, 0, 0);
+	XFlush(r->d);
 }
 
 static void
 draw(struct rendering *r, char *text, struct completions *cs)
 {
-	/* Draw the background */
-	XFillRectangle(r->d, r->w, r->bgs[1], r->x_zero, r->y_zero,
-	    INNER_WIDTH(r), INNER_HEIGHT(r));
+	char status[64];
+	int len, width = 0;
+
+	buf_resize(r);
+
+	if ((len = status_text(r, cs, status, sizeof(status))) != 0)
+		text_extents(status, len, r, &width, NULL);
 
 	/* Draw the contents */
 	if (r->horizontal_layout)
-		draw_horizontally(r, text, cs);
+		draw_horizontally(r, text, cs, INNER_WIDTH(r) - width -
+		    r->p_padding[1] - r->p_padding[3]);
 	else
 		draw_vertically(r, text, cs);
 
+	if (len != 0)
+		draw_status(r, status, len, width);
+
 	/* Draw the borders */
 	if (r->borders[0] != 0)
-		XFillRectangle(r->d, r->w, r->borders_bg[0], 0, 0, r->width,
+		XFillRectangle(r->d, r->buf, r->borders_bg[0], 0, 0, r->width,
 		    r->borders[0]);
 
 	if (r->borders[1] != 0)
-		XFillRectangle(r->d, r->w, r->borders_bg[1],
+		XFillRectangle(r->d, r->buf, r->borders_bg[1],
 		    r->width - r->borders[1], 0, r->borders[1],
 		    r->height);
 
 	if (r->borders[2] != 0)
-		XFillRectangle(r->d, r->w, r->borders_bg[2], 0,
+		XFillRectangle(r->d, r->buf, r->borders_bg[2], 0,
 		    r->height - r->borders[2], r->width, r->borders[2]);
 
 	if (r->borders[3] != 0)
-		XFillRectangle(r->d, r->w, r->borders_bg[3], 0, 0,
+		XFillRectangle(r->d, r->buf, r->borders_bg[3], 0, 0,
 		    r->borders[3], r->height);
 
 	/* render! */
-	XFlush(r->d);
+	present(r);
 }
 
 /* Set some WM stuff */
@@ -980,6 +4567,21 @@ parse_integer(const char *str, int def)
 	return i;
 }
 
+/* Parse the name of a match mode, `def' if it's unknown */
+static enum match_mode
+parse_match_mode(const char *str, enum match_mode def)
+{
+	if (!strcmp(str, "substring"))
+		return MATCH_SUBSTRING;
+	if (!strcmp(str, "fuzzy"))
+		return MATCH_FUZZY;
+	if (!strcmp(str, "regex"))
+		return MATCH_REGEX;
+
+	warnx("unknown match mode '%s'", str);
+	return def;
+}
+
 /*
  * Like parse_integer but recognize the percentages (i.e. strings
  * ending with `%')
@@ -1168,24 +4770,19 @@ parse_event(Display *d, XKeyPressedEvent *ev, XIC xic, char **input)
 
 static void
 confirm(enum state *status, struct rendering *r, struct completions *cs,
-    char **text, int *textlen)
+    struct history *hist, char **text, int *textlen)
 {
 	if ((cs->selected != -1) || (cs->length > 0 && r->first_selected)) {
 		/* if there is something selected expand it and return */
 		int index = cs->selected == -1 ? 0 : cs->selected;
-		struct completion *c = cs->completions;
+		uint32_t c = cs->completions[index];
 		char *t;
 
-		while (1) {
-			if (index == 0)
-				break;
-			c++;
-			index--;
-		}
-
-		t = c->rcompletion;
+		t = cs->items->lines[c];
+		if (hist != NULL)
+			history_add(hist, t, cs->items->lens[c]);
 		free(*text);
-		*text = strdup(t);
+		*text = strndup(t, cs->items->lens[c]);
 
 		if (*text == NULL) {
 			fprintf(stderr, "Memory allocation error\n");
@@ -1210,29 +4807,19 @@ static enum action
 select_clicked(struct completions *cs, ssize_t offset, size_t first,
     enum action def)
 {
-	ssize_t selected = first;
-	int set = 0;
+	size_t i;
 
-	if (cs->length == 0)
+	if (cs->length == 0 || cs->noffsets == 0)
 		return NO_OP;
 
-	if (offset < cs->completions[selected].offset)
+	if (offset < cs->offsets[0])
 		return EXIT;
 
 	/* skip the first entry */
-	for (selected += 1; selected < (ssize_t)cs->length; ++selected) {
-		if (cs->completions[selected].offset == -1)
-			break;
-
-		if (offset < cs->completions[selected].offset) {
-			cs->selected = selected - 1;
-			set = 1;
+	for (i = 1; i < cs->noffsets; ++i)
+		if (offset < cs->offsets[i])
 			break;
-		}
-	}
-
-	if (!set)
-		cs->selected = selected - 1;
+	cs->selected = first + i - 1;
 
 	return def;
 }
@@ -1265,18 +4852,427 @@ handle_mouse(struct rendering *r, struct completions *cs,
 	return NO_OP;
 }
 
+/*
+ * Read the items available on stdin.  They're filtered later, like
+ * the ones that weren't needed to fill the screen.
+ */
+static void
+ingest(struct rendering *r, struct items *items)
+{
+	readlines(items);
+	r->nitems = items->len;
+	r->loading = items->fd != -1;
+}
+
+/*
+ * An upper bound of how many completions fit in the window from
+ * r->offset, assuming that the ones in the horizontal layout are at
+ * least a glyph, about half as wide as the text is high, long.
+ */
+static size_t
+screenful(struct rendering *r)
+{
+	int n;
+
+	if (r->horizontal_layout)
+		n = INNER_WIDTH(r) / MAX(r->c_borders[1] + r->c_padding[1] +
+		    r->text_height / 2 + r->c_padding[3] + r->c_borders[3], 1);
+	else
+		n = INNER_HEIGHT(r) / MAX(r->c_borders[0] + r->c_padding[0] +
+		    r->text_height + r->c_padding[2] + r->c_borders[2], 1);
+
+	return r->offset + MAX(n, 0) + 1;
+}
+
+/* Is there work to do when nothing else is going on? */
+static int
+idle_work(struct completions *cs, struct items *items)
+{
+	return cs->nitems < items->len ||
+	    (items->use_index && items->tri == NULL && items->fd == -1);
+}
+
+/*
+ * Run a job: filter the items for the query `text', that is then
+ * freed, or do a step of the idle work: build the index or filter
+ * the items that weren't needed until now.
+ */
+static void
+worker_run(struct worker *w, char *text, size_t want, short first_selected)
+{
+	struct completions *cs = w->cs;
+	struct items *items = w->items;
+
+	if (text != NULL) {
+		update_completions(cs, text, items, first_selected, want, w);
+		free(text);
+		return;
+	}
+
+	if (items->use_index && items->tri == NULL && items->fd == -1)
+		index_build(items);
+	else
+		filter(cs, items, MIN(cs->nitems + IDLE_STEP, items->len));
+	if (first_selected && cs->selected == -1 && cs->length > 0)
+		cs->selected = 0;
+}
+
+#if HAVE_PTHREAD
+static void *
+worker_main(void *arg)
+{
+	struct worker *w = arg;
+	char *text;
+	size_t want;
+	short first_selected;
+
+	pthread_mutex_lock(&w->mtx);
+	for (;;) {
+		while (!w->pending && !w->quit)
+			pthread_cond_wait(&w->cond, &w->mtx);
+		if (w->quit)
+			break;
+
+		text = w->text;
+		want = w->want;
+		first_selected = w->first_selected;
+		w->text = NULL;
+		w->pending = 0;
+		w->jobgen = w->gen;
+		pthread_mutex_unlock(&w->mtx);
+
+		worker_run(w, text, want, first_selected);
+
+		pthread_mutex_lock(&w->mtx);
+		if (!w->pending) {
+			w->busy = 0;
+			/* if the pipe is full the loop will wake up anyway */
+			if (write(w->done[1], "", 1) == -1 && errno != EAGAIN)
+				err(1, "write");
+		}
+	}
+	pthread_mutex_unlock(&w->mtx);
+
+	return NULL;
+}
+#endif
+
+/* Start the worker for the completions `cs' of `items' */
+static void
+worker_start(struct worker *w, struct completions *cs, struct items *items)
+{
+	memset(w, 0, sizeof(*w));
+	w->cs = cs;
+	w->items = items;
+	w->view.items = items;
+	w->done[0] = w->done[1] = -1;
+
+#if HAVE_PTHREAD
+	if (pipe(w->done) == -1)
+		err(1, "pipe");
+	if (fcntl(w->done[0], F_SETFL, O_NONBLOCK) == -1 ||
+	    fcntl(w->done[1], F_SETFL, O_NONBLOCK) == -1)
+		err(1, "fcntl");
+
+	if (pthread_mutex_init(&w->mtx, NULL) != 0 ||
+	    pthread_cond_init(&w->cond, NULL) != 0)
+		errx(1, "can't initialize the worker");
+	w->started = pthread_create(&w->th, NULL, worker_main, w) == 0;
+#endif
+}
+
+/* Stop the worker, dropping what it's doing */
+static void
+worker_stop(struct worker *w)
+{
+#if HAVE_PTHREAD
+	if (w->started) {
+		pthread_mutex_lock(&w->mtx);
+		w->quit = 1;
+		w->gen++;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->mtx);
+		pthread_join(w->th, NULL);
+	}
+	if (w->done[0] != -1) {
+		close(w->done[0]);
+		close(w->done[1]);
+	}
+	pthread_mutex_destroy(&w->mtx);
+	pthread_cond_destroy(&w->cond);
+#endif
+	free(w->text);
+	free(w->view.completions);
+	free(w->view.marks);
+	free(w->view.marked);
+	free(w->view.offsets);
+}
+
+/* Is the worker busy with the completions? */
+static int
+worker_busy(struct worker *w)
+{
+	int busy = 0;
+
+#if HAVE_PTHREAD
+	if (w->started) {
+		pthread_mutex_lock(&w->mtx);
+		busy = w->busy;
+		pthread_mutex_unlock(&w->mtx);
+	}
+#endif
+	return busy;
+}
+
+/*
+ * Give a job to the worker, see worker_run().  A query replaces the
+ * one still pending, if any, and makes the running one stale.
+ */
+static void
+worker_submit(struct worker *w, char *text, size_t want,
+    short first_selected)
+{
+#if HAVE_PTHREAD
+	if (w->started) {
+		pthread_mutex_lock(&w->mtx);
+		free(w->text);
+		w->text = text;
+		w->want = want;
+		w->first_selected = first_selected;
+		w->pending = 1;
+		w->busy = 1;
+		w->gen++;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->mtx);
+		return;
+	}
+#endif
+	worker_run(w, text, want, first_selected);
+}
+
+/* Consume the notifications of the worker */
+static void
+worker_drain(struct worker *w)
+{
+	char buf[64];
+
+	while (read(w->done[0], buf, sizeof(buf)) > 0)
+		;
+}
+
+/*
+ * Wait up to `timeout' milliseconds, or forever if -1, for the worker
+ * to be done.  Return 1 if it's still busy.
+ */
+static int
+worker_wait(struct worker *w, int timeout)
+{
+	struct pollfd pfd;
+	struct timespec now, end;
+	int left = timeout;
+
+	pfd.fd = w->done[0];
+	pfd.events = POLLIN;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += timeout / 1000;
+	end.tv_nsec += (timeout % 1000) * 1000000L;
+
+	/* there may be notifications of the previous jobs in the pipe */
+	while (worker_busy(w)) {
+		if (timeout != -1) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			left = (end.tv_sec - now.tv_sec) * 1000 +
+			    (end.tv_nsec - now.tv_nsec) / 1000000;
+			if (left <= 0)
+				return 1;
+		}
+		if (poll(&pfd, 1, left) == -1 && errno != EINTR)
+			err(1, "poll");
+		worker_drain(w);
+	}
+
+	return 0;
+}
+
+/*
+ * Copy in the view of the worker the completions on the screen, so
+ * that they can still be drawn while the worker works on the
+ * completions.  They're stored from the first, since the list is
+ * scrolled to the top for the new query.
+ */
+static void
+view_save(struct rendering *r, struct worker *w)
+{
+	struct completions *cs = w->cs, *v = &w->view;
+	const struct mark *m;
+	size_t i, j, n = 0, nm, first;
+
+	if (r->offset < cs->length)
+		n = MIN(cs->length - r->offset, screenful(r) - r->offset);
+
+	if (v->cap < n) {
+		void *t;
+
+		t = reallocarray(v->completions, n, sizeof(uint32_t));
+		if (t == NULL)
+			err(1, "reallocarray");
+		v->completions = t;
+		v->cap = n;
+	}
+
+	if (n != 0)
+		memcpy(v->completions, cs->completions + r->offset,
+		    n * sizeof(uint32_t));
+	v->length = n;
+
+	/* the marks too, the view has no query to find them */
+	v->nmarks = 0;
+	v->nmarked = 0;
+	v->marksgen++;
+	for (i = 0; i < n; ++i) {
+		m = marks_get(cs, v->completions[i], &nm);
+		first = v->nmarks;
+		for (j = 0; j < nm; ++j)
+			mark_add(v, m[j].start, m[j].end);
+		marked_add(v, v->completions[i], first);
+	}
+	v->selected = -1;
+	if (cs->selected >= (ssize_t)r->offset)
+		v->selected = cs->selected - r->offset;
+}
+
+/*
+ * Filter the completions again for `text', that was just edited.
+ * The worker is given a little time, so that the window isn't drawn
+ * with the old completions when the filter is quick.
+ */
+static void
+requery(struct rendering *r, struct worker *w, const char *text)
+{
+	char *t;
+
+	if (w->started && !worker_busy(w))
+		view_save(r, w);
+	r->offset = 0;
+
+	if ((t = strdup(text)) == NULL)
+		err(1, "strdup");
+	worker_submit(w, t, screenful(r), r->first_selected);
+	worker_wait(w, WORKER_WAIT);
+}
+
+/*
+ * Draw the window: with the completions, or with the copy of the old
+ * ones if the worker is still busy.
+ */
+static void
+show(struct rendering *r, char *text, struct completions *cs,
+    struct worker *w)
+{
+	r->filtering = worker_busy(w);
+	draw(r, text, r->filtering ? &w->view : cs);
+}
+
+/* Does the action only edit the text?  Those don't need the list. */
+static int
+edits_text(enum action a)
+{
+	return a == DEL_CHAR || a == DEL_WORD || a == DEL_LINE ||
+	    a == ADD_CHAR;
+}
+
+/*
+ * Wait until there's something to do: an X event, new items to read
+ * or the worker done with its job.  stdin isn't read while the worker
+ * is busy, since the items can't change under it.  Return 1 if the
+ * window has to be drawn again.
+ */
+static int
+wait_input(struct rendering *r, struct items *items, struct worker *w)
+{
+	struct pollfd pfd[3];
+	int busy, redraw = 0;
+
+	busy = worker_busy(w);
+
+	pfd[0].fd = ConnectionNumber(r->d);
+	pfd[0].events = POLLIN;
+	pfd[1].fd = busy ? -1 : items->fd;
+	pfd[1].events = POLLIN;
+	pfd[2].fd = w->done[0];
+	pfd[2].events = POLLIN;
+
+	if (poll(pfd, 3, -1) == -1) {
+		if (errno == EINTR)
+			return 0;
+		err(1, "poll");
+	}
+
+	if (pfd[2].revents & POLLIN) {
+		worker_drain(w);
+		redraw = busy && !worker_busy(w);
+	}
+
+	if (pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+		ingest(r, items);
+		redraw = 1;
+	}
+
+	return redraw;
+}
+
 /* event loop */
 static enum state
 loop(struct rendering *r, char **text, int *textlen, struct completions *cs,
-    char **lines, char **vlines)
+    struct items *items, struct worker *w)
 {
 	enum action a;
 	char *input = NULL;
 	enum state status = LOOPING;
+	short edited = 0, redraw = 0;
 	int i;
 
 	while (status == LOOPING) {
 		XEvent e;
+
+		/*
+		 * The events are handled in batches: the completions are
+		 * filtered, and the window drawn, only once all the queued
+		 * ones are handled, so that a paste or a fast typist
+		 * don't filter the items for every key.
+		 */
+		if ((edited || redraw) && !XPending(r->d)) {
+			if (edited)
+				requery(r, w, *text);
+			show(r, *text, cs, w);
+			edited = redraw = 0;
+		}
+
+		if (!XPending(r->d) && !worker_busy(w) &&
+		    idle_work(cs, items)) {
+			/*
+			 * The step may take long, e.g. the index: if a key
+			 * comes meanwhile, what's on the screen is kept.
+			 */
+			if (w->started)
+				view_save(r, w);
+			worker_submit(w, NULL, 0, r->first_selected);
+			if (!worker_busy(w))
+				show(r, *text, cs, w);
+			continue;
+		}
+
+		/*
+		 * Don't block on X while there are still items to read
+		 * or the worker is busy
+		 */
+		if (!XPending(r->d) && (items->fd != -1 || worker_busy(w))) {
+			if (wait_input(r, items, w))
+				show(r, *text, cs, w);
+			continue;
+		}
+
 		XNextEvent(r->d, &e);
 
 		if (XFilterEvent(&e, r->w))
@@ -1300,17 +5296,42 @@ loop(struct rendering *r, char **text, int *textlen, struct completions *cs,
 
 		case MapNotify:
 			get_wh(r->d, &r->w, &r->width, &r->height);
-			draw(r, *text, cs);
 			break;
 
+		case Expose:
+			/* the back buffer still has the last frame */
+			if (e.xexpose.count == 0)
+				present(r);
+			continue;
+
 		case KeyPress:
 		case ButtonPress:
 			if (e.type == KeyPress)
 				a = parse_event(r->d, (XKeyPressedEvent *)&e,
 				    r->xic, &input);
-			else
+			else {
+				/* the click is on the completions drawn */
+				if (edited || worker_busy(w)) {
+					if (edited)
+						requery(r, w, *text);
+					edited = 0;
+					worker_wait(w, -1);
+					show(r, *text, cs, w);
+				}
 				a = handle_mouse(r, cs,
 				    (XButtonPressedEvent *)&e);
+			}
+
+			/*
+			 * Only the text can change while filtering, and
+			 * the edits queued must be applied first
+			 */
+			if (a != NO_OP && a != EXIT && !edits_text(a)) {
+				if (edited)
+					requery(r, w, *text);
+				edited = 0;
+				worker_wait(w, -1);
+			}
 
 			switch (a) {
 			case NO_OP:
@@ -1322,21 +5343,27 @@ loop(struct rendering *r, char **text, int *textlen, struct completions *cs,
 
 			case CONFIRM:
 				status = OK;
-				confirm(&status, r, cs, text, textlen);
+				confirm(&status, r, cs, items->hist, text,
+				    textlen);
 				break;
 
 			case CONFIRM_CONTINUE:
 				status = OK_LOOP;
-				confirm(&status, r, cs, text, textlen);
+				confirm(&status, r, cs, items->hist, text,
+				    textlen);
 				break;
 
 			case PREV_COMPL:
+				/* going back from the first wraps around */
+				if (cs->selected <= 0)
+					fill(cs, items, SIZE_MAX, NULL);
 				complete(cs, r->first_selected, 1, text,
 				    textlen, &status);
 				r->offset = cs->selected;
 				break;
 
 			case NEXT_COMPL:
+				fill(cs, items, cs->selected + 2, NULL);
 				complete(cs, r->first_selected, 0, text,
 				    textlen, &status);
 				r->offset = cs->selected;
@@ -1344,23 +5371,18 @@ loop(struct rendering *r, char **text, int *textlen, struct completions *cs,
 
 			case DEL_CHAR:
 				popc(*text);
-				update_completions(cs, *text, lines, vlines,
-				    r->first_selected);
-				r->offset = 0;
+				edited = 1;
 				break;
 
 			case DEL_WORD:
 				popw(*text);
-				update_completions(cs, *text, lines, vlines,
-				    r->first_selected);
+				edited = 1;
 				break;
 
 			case DEL_LINE:
 				for (i = 0; i < *textlen; ++i)
 					(*text)[i] = 0;
-				update_completions(cs, *text, lines, vlines,
-				    r->first_selected);
-				r->offset = 0;
+				edited = 1;
 				break;
 
 			case ADD_CHAR:
@@ -1386,12 +5408,9 @@ loop(struct rendering *r, char **text, int *textlen, struct completions *cs,
 				}
 
 				if (status != ERR) {
-					update_completions(cs, *text, lines,
-					    vlines, r->first_selected);
+					edited = 1;
 					free(input);
 				}
-
-				r->offset = 0;
 				break;
 
 			case TOGGLE_FIRST_SELECTED:
@@ -1403,6 +5422,7 @@ loop(struct rendering *r, char **text, int *textlen, struct completions *cs,
 				break;
 
 			case SCROLL_DOWN:
+				fill(cs, items, screenful(r) + 1, NULL);
 				r->offset = MIN(r->offset + 1, cs->length - 1);
 				break;
 
@@ -1412,16 +5432,29 @@ loop(struct rendering *r, char **text, int *textlen, struct completions *cs,
 			}
 		}
 
-		draw(r, *text, cs);
+		redraw = 1;
 	}
 
+	if (redraw)
+		show(r, *text, cs, w);
+
 	return status;
 }
 
 static int
 load_font(struct rendering *r, const char *fontname)
 {
+	size_t i;
+
 	r->font = XftFontOpenName(r->d, DefaultScreen(r->d), fontname);
+
+	/* the widths measured with another font are stale */
+	if (r->widths == NULL &&
+	    (r->widths = calloc(WIDTHS_CACHE, sizeof(*r->widths))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < WIDTHS_CACHE; ++i)
+		r->widths[i].index = UINT32_MAX;
+	glyphs_reset(r);
 	return 0;
 }
 
@@ -1497,14 +5530,14 @@ static void
 usage(char *prgname)
 {
 	fprintf(stderr,
-	    "%s [-Aahmv] [-B colors] [-b size] [-C color] [-c color]\n"
-	    "       [-d separator] [-e window] [-f font] [-G color] [-g "
-	    "size]\n"
-	    "       [-H height] [-I color] [-i size] [-J color] [-j "
-	    "size] [-l layout]\n"
-	    "       [-P padding] [-p prompt] [-S color] [-s color] [-T "
-	    "color]\n"
-	    "       [-t color] [-W width] [-x coord] [-y coord]\n",
+	    "%s [-0AahmvX] [-B colors] [-b size] [-C color] [-c color]\n"
+	    "       [-d separator] [-e window] [-F file] [-f font] [-G color]\n"
+	    "       [-g size]"
+	    " [-H height] [-I color] [-i size] [-J color] [-j size]\n"
+	    "       [-l layout] [-M mode]"
+	    " [-P padding] [-p prompt] [-R file] [-S color]\n"
+	    "       [-s color] [-T color] [-t color] [-W width] [-x coord]\n"
+	    "       [-y coord]\n",
 	    prgname);
 }
 
@@ -1512,13 +5545,16 @@ int
 main(int argc, char **argv)
 {
 	struct completions *cs;
+	struct items items;
+	struct worker w;
+	struct history hist;
 	struct rendering r;
 	XVisualInfo vinfo;
 	Colormap cmap;
-	size_t nlines, i;
+	size_t i;
 	Window parent_window;
 	XrmDatabase xdb;
-	unsigned long fgs[3], bgs[3]; /* prompt, compl, compl_highlighted */
+	unsigned long fgs[4], bgs[3]; /* prompt, compl, compl_highlighted */
 	unsigned long borders_bg[4], p_borders_bg[4], c_borders_bg[4],
 		ch_borders_bg[4]; /* N E S W */
 	enum state status = LOOPING;
@@ -1526,15 +5562,20 @@ main(int argc, char **argv)
 	int offset_x = 0, offset_y = 0;
 	int x = 0, y = 0;
 	int textlen, d_width, d_height;
-	short embed;
+	short embed, use_index = 0;
 	const char *sep = NULL;
+	const char *file = NULL;
+	const char *histfile = NULL;
 	const char *parent_window_id = NULL;
 	char *tmp[4];
-	char **lines, **vlines;
 	char *fontname, *text, *xrm;
 
 	setlocale(LC_ALL, getenv("LANG"));
 
+#if defined(TARGET_AVX2)
+	avx2 = __builtin_cpu_supports("avx2");
+#endif
+
 	for (i = 0; i < 4; ++i) {
 		/* default paddings */
 		r.p_padding[i] = 10;
@@ -1551,7 +5592,19 @@ main(int argc, char **argv)
 	r.first_selected = 0;
 	r.free_text = 1;
 	r.multiple_select = 0;
+	r.nul_output = 0;
 	r.offset = 0;
+	r.widths = NULL;
+	r.glyphs = NULL;
+	r.nglyphs = 0;
+	r.glyphscap = 0;
+	r.boxes = NULL;
+	r.nboxes = 0;
+	r.next = NULL;
+	r.nnext = 0;
+	r.boxescap = 0;
+	r.drawn = NULL;
+	r.drawngen = 0;
 
 	/* default width and height */
 	r.width = 400;
@@ -1584,43 +5637,67 @@ main(int argc, char **argv)
 			if ((sep = strdup(optarg)) == NULL)
 				err(1, "strdup");
 			break;
+		case 'F':
+			file = optarg;
+			break;
+		case 'R':
+			histfile = optarg;
+			break;
 		case 'A':
 			r.free_text = 0;
 			break;
 		case 'm':
 			r.multiple_select = 1;
 			break;
+		case '0':
+			r.nul_output = 1;
+			break;
+		case 'X':
+			use_index = 1;
+			break;
 		default:
 			break;
 		}
 	}
 
-	lines = readlines(&nlines);
+	/*
+	 * Regular files are mmap'd, everything else is read from stdin
+	 * while the window is already shown, see loop().
+	 */
+	memset(&items, 0, sizeof(items));
+	items.fd = STDIN_FILENO;
+	items.delim = r.nul_output ? '\0' : '\n';
+	items.sep = sep;
+	if (sep != NULL)
+		items.seplen = strlen(sep);
+	items.use_index = use_index;
+
+	/* the items are looked up in the history while they're read */
+	if (histfile != NULL) {
+		history_open(&hist, histfile);
+		items.hist = &hist;
+	}
+
+	if (file != NULL && (items.fd = open(file, O_RDONLY)) == -1)
+		err(1, "open %s", file);
 
-	vlines = NULL;
-	if (sep != NULL) {
-		int l;
-		l = strlen(sep);
-		if ((vlines = calloc(nlines, sizeof(char *))) == NULL)
-			err(1, "calloc");
+	if (mapfile(&items, items.fd) == 0 && file != NULL)
+		close(items.fd);
 
-		for (i = 0; i < nlines; i++) {
-			char *t;
-			t = strstr(lines[i], sep);
-			if (t == NULL)
-				vlines[i] = lines[i];
-			else
-				vlines[i] = t + l;
-		}
-	}
+	r.loading = items.fd != -1;
+	r.nitems = items.len;
+	r.filtering = 0;
 
 	textlen = 10;
 	if ((text = malloc(textlen * sizeof(char))) == NULL)
 		err(1, "malloc");
+	*text = '\0';
 
-	/* struct completions *cs = filter(text, lines); */
-	if ((cs = compls_new(nlines)) == NULL)
+	if ((cs = compls_new(32)) == NULL)
 		err(1, "compls_new");
+	cs->snapsmax = (size_t)DEFSNAPSHOTS * 1024 * 1024;
+	cs->frecency = items.hist != NULL;
+	cs->items = &items;
 
 	/* start talking to xorg */
 	r.d = XOpenDisplay(NULL);
@@ -1647,6 +5724,7 @@ main(int argc, char **argv)
 
 	fgs[0] = fgs[1] = parse_color("#fff", NULL);
 	fgs[2] = parse_color("#000", NULL);
+	fgs[3] = parse_color("#f90", NULL); /* the matches */
 
 	bgs[0] = bgs[1] = parse_color("#000", NULL);
 	bgs[2] = parse_color("#fff", NULL);
@@ -1796,6 +5874,10 @@ main(int argc, char **argv)
 			}
 		}
 
+		/* The matches in the completions */
+		if (XrmGetResource(xdb, "MyMenu.completion_match.foreground", "*", datatype, &value))
+			fgs[3] = parse_color(value.addr, "#f90");
+
 		/* Completion Highlighted */
 		if (XrmGetResource(
 			    xdb, "MyMenu.completion_highlighted.foreground", "*", datatype, &value))
@@ -1848,6 +5930,13 @@ main(int argc, char **argv)
 				free(tmp[i]);
 			}
 		}
+
+		if (XrmGetResource(xdb, "MyMenu.snapshots.size", "*", datatype, &value))
+			cs->snapsmax = (size_t)MAX(parse_integer(value.addr,
+			    DEFSNAPSHOTS), 0) * 1024 * 1024;
+
+		if (XrmGetResource(xdb, "MyMenu.match", "*", datatype, &value))
+			cs->mode = parse_match_mode(value.addr, cs->mode);
 	}
 
 	/* Second round of args parsing */
@@ -1857,10 +5946,18 @@ main(int argc, char **argv)
 		case 'a':
 			r.first_selected = 1;
 			break;
+		case '0':
+			/* NUL-separated items -- already catched */
 		case 'A':
 			/* free_text -- already catched */
+		case 'X':
+			/* trigram index -- already catched */
 		case 'd':
 			/* separator -- this case was already catched */
+		case 'F':
+			/* input file -- this case was already catched */
+		case 'R':
+			/* history file -- this case was already catched */
 		case 'e':
 			/* embedding mymenu this case was already catched. */
 		case 'm':
@@ -1927,6 +6024,9 @@ main(int argc, char **argv)
 		case 'l':
 			r.horizontal_layout = !strcmp(optarg, "horizontal");
 			break;
+		case 'M':
+			cs->mode = parse_match_mode(optarg, cs->mode);
+			break;
 		case 'f': {
 			char *newfont;
 			if ((newfont = strdup(optarg)) != NULL) {
@@ -1983,10 +6083,6 @@ main(int argc, char **argv)
 		status = ERR;
 	}
 
-	/* since only now we know if the first should be selected,
-	 * update the completion here */
-	update_completions(cs, text, lines, vlines, r.first_selected);
-
 	/* update the prompt lenght, only now we surely know the length of it
 	 */
 	r.ps1len = strlen(r.ps1);
@@ -2030,6 +6126,10 @@ main(int argc, char **argv)
 			r.c_borders_bg[i] = XCreateGC(r.d, r.w, 0, &values);
 			r.ch_borders_bg[i] = XCreateGC(r.d, r.w, 0, &values);
 		}
+
+		/* XCopyArea() would send a NoExpose every time */
+		values.graphics_exposures = False;
+		r.copygc = XCreateGC(r.d, r.w, GCGraphicsExposures, &values);
 	}
 
 	/* Load the colors in our GCs */
@@ -2048,9 +6148,13 @@ main(int argc, char **argv)
 	if (load_font(&r, fontname) == -1)
 		status = ERR;
 
-	r.xftdraw = XftDrawCreate(r.d, r.w, vinfo.visual, cmap);
+	r.depth = vinfo.depth;
+	r.buf = XCreatePixmap(r.d, r.w, r.width, r.height, r.depth);
+	r.bufwidth = r.width;
+	r.bufheight = r.height;
+	r.xftdraw = XftDrawCreate(r.d, r.buf, vinfo.visual, cmap);
 
-	for (i = 0; i < 3; ++i) {
+	for (i = 0; i < 4; ++i) {
 		rgba_t c;
 		XRenderColor xrcolor;
 
@@ -2075,15 +6179,29 @@ main(int argc, char **argv)
 	/* Cache text height */
 	text_extents("fyjpgl", 6, &r, NULL, &r.text_height);
 
+	/*
+	 * since only now we know if the first should be selected, and
+	 * how many completions fit in the window, update the
+	 * completion here
+	 */
+	update_completions(cs, text, &items, r.first_selected,
+	    screenful(&r), NULL);
+
 	/* Draw the window for the first time */
 	draw(&r, text, cs);
 
+	worker_start(&w, cs, &items);
+
 	/* Main loop */
 	while (status == LOOPING || status == OK_LOOP) {
-		status = loop(&r, &text, &textlen, cs, lines, vlines);
+		status = loop(&r, &text, &textlen, cs, &items, &w);
 
-		if (status != ERR)
-			printf("%s\n", text);
+		if (status != ERR) {
+			if (r.nul_output)
+				fwrite(text, 1, strlen(text) + 1, stdout);
+			else
+				printf("%s\n", text);
+		}
 
 		if (!r.multiple_select && status == OK_LOOP)
 			status = OK;
@@ -2091,7 +6209,7 @@ main(int argc, char **argv)
 
 	XUngrabKeyboard(r.d, CurrentTime);
 
-	for (i = 0; i < 3; ++i)
+	for (i = 0; i < 4; ++i)
 		XftColorFree(r.d, vinfo.visual, cmap, &r.xft_colors[i]);
 
 	for (i = 0; i < 3; ++i) {
@@ -2105,21 +6223,29 @@ main(int argc, char **argv)
 		XFreeGC(r.d, r.c_borders_bg[i]);
 		XFreeGC(r.d, r.ch_borders_bg[i]);
 	}
+	XFreeGC(r.d, r.copygc);
 
 	XDestroyIC(r.xic);
 	XCloseIM(r.xim);
 
-	for (i = 0; i < 3; ++i)
+	for (i = 0; i < 4; ++i)
 		XftColorFree(r.d, vinfo.visual, cmap, &r.xft_colors[i]);
 	XftFontClose(r.d, r.font);
 	XftDrawDestroy(r.xftdraw);
+	XFreePixmap(r.d, r.buf);
 
 	free(r.ps1);
+	free(r.widths);
+	free(r.glyphs);
+	free(r.boxes);
+	free(r.next);
 	free(fontname);
 	free(text);
 
-	free(lines);
-	free(vlines);
+	worker_stop(&w);
+	if (items.hist != NULL)
+		history_close(items.hist);
+	items_free(&items);
 	compls_delete(cs);
 
 	XFreeColormap(r.d, cmap);
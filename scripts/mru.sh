@@ -0,0 +1,34 @@
+#!/bin/sh
+
+cache="${XDG_CACHE_HOME:-$HOME/.cache}"
+hist="$cache/mymenu.hist"
+progs="$cache/mymenu.path"
+path=`echo $PATH | sed 's/:/ /g'`
+
+mkdir -p "$cache" || exit 1
+
+# the list of programs is built again only when PATH, or one of its
+# directories, changed since the last time
+stale() {
+	[ -f "$progs" ] || return 0
+	[ "`sed 1q "$progs"`" = "$PATH" ] || return 0
+	for p in $path; do
+		[ "$p" -nt "$progs" ] && return 0
+	done
+	return 1
+}
+
+if stale; then
+	{
+		echo "$PATH"
+		for p in $path; do
+			for f in "$p"/*; do
+				[ -x "$f" ] && [ ! -d "$f" ] && echo "${f##*/}"
+			done
+		done | sort -fu
+	} > "$progs.$$" && mv -f "$progs.$$" "$progs" || exit 1
+fi
+
+sed 1d "$progs" | mymenu -R "$hist" "$@" | while read -r prog; do
+	$prog &
+done
@@ -0,0 +1,17 @@
+#include <pthread.h>
+
+static void *
+start(void *arg)
+{
+	return arg;
+}
+
+int
+main(void)
+{
+	pthread_t t;
+
+	if (pthread_create(&t, NULL, start, NULL) != 0)
+		return 1;
+	return pthread_join(t, NULL) != 0;
+}